@@ -0,0 +1,560 @@
+/*
+ * Array evaluation.
+ *
+ * An expression that produces an array is not evaluated node by node, since
+ * every operator would then make a temporary as big as the result. Instead
+ * the expression is turned into a plan, which is a list of steps in the order
+ * that the tree would be evaluated. The plan is then run over the arrays one
+ * block at a time, with each step writing a block sized buffer that stays in
+ * the cache. Only the result is as big as the arrays.
+ *
+ * Parts of the expression that do not involve an array are evaluated once,
+ * when the plan is made, and are broadcast to every element. A zero divisor
+ * in any element is reported the same as for numbers, and the expression has
+ * no value.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "ast.h"
+#include "array.h"
+#include "builtin.h"
+#include "memory.h"
+#include "error.h"
+#include "symbols.h"
+#include "job.h"
+
+#define BLOCK_SIZE  0x200   // elements per block, 4k bytes
+#define ALIGN       64
+#define SHOW_ITEMS  3       // items shown at each end of a long array
+#define MAX_RANGE   0x1p63  // range() lengths from here on do not fit in 64 bits
+
+typedef enum {
+    DATA_STEP,      // a block of an existing array
+    FILL_STEP,      // a scalar broadcast to the whole block
+    RANGE_STEP,     // start, start + 1, ...
+    NEG_STEP,
+    ABS_STEP,
+    BINARY_STEP,
+    CALL_STEP,
+} step_kind_t;
+
+typedef struct {
+    step_kind_t kind;
+    int op;             // op_type_t or builtin index
+    int a;              // operand steps, -1 if not used
+    int b;
+    array_t* array;     // DATA_STEP, holds a reference
+    double start;       // RANGE_STEP
+    double* buf;        // block buffer for every step but DATA_STEP
+    const double* out;  // this step's values for the current block
+} step_t;
+
+typedef struct {
+    step_t* steps;
+    int len;
+    int cap;
+    int64_t length;     // -1 until an array operand is seen
+    bool failed;
+    bool zero_divisor;  // set when a block divides by zero
+} plan_t;
+
+// number of symbols that hold an array plus the number of calls that make
+// one, so scalar scripts never look for arrays
+static atomic_int array_uses = 0;
+
+void use_arrays(int delta) {
+
+    atomic_fetch_add(&array_uses, delta);
+}
+
+bool arrays_in_use(void) {
+
+    return atomic_load(&array_uses) != 0;
+}
+
+/*
+ * Create an array. The contents are not cleared. An array can be as big as
+ * the user asks for, so running out of memory is reported with error() and
+ * NULL is returned, instead of ending the program.
+ */
+array_t* create_array(int64_t len) {
+
+    void* data = NULL;
+    if(len < 0 || (uint64_t)len > SIZE_MAX / sizeof(double) ||
+            posix_memalign(&data, ALIGN, (len > 0)? (size_t)len * sizeof(double) : ALIGN) != 0) {
+        error("cannot allocate an array of %" PRId64 " numbers", len);
+        return NULL;
+    }
+
+    array_t* array = ALLOC_DS(array_t);
+    array->len = len;
+    array->data = data;
+    atomic_init(&array->refs, 1);
+
+    return array;
+}
+
+array_t* ref_array(array_t* array) {
+
+    atomic_fetch_add(&array->refs, 1);
+    return array;
+}
+
+void unref_array(array_t* array) {
+
+    if(atomic_fetch_sub(&array->refs, 1) == 1) {
+        FREE(array->data);
+        FREE(array);
+    }
+}
+
+/*
+ * Print the length and the first and last few items of the array.
+ */
+void print_array(const char* prefix, array_t* array) {
+
+    printf("%sarray[%" PRId64 "]", prefix, array->len);
+    for(int64_t i = 0; i < array->len; i++) {
+        if(array->len > SHOW_ITEMS * 2 && i == SHOW_ITEMS) {
+            printf(" ...");
+            i = array->len - SHOW_ITEMS;
+        }
+        printf(" %0.*f", FLOAT_DIGITS, array->data[i]);
+    }
+    printf("\n");
+}
+
+/*
+ * Read a file of native doubles into a new array.
+ */
+static array_t* load_array(const char* fname) {
+
+    FILE* fp = fopen(fname, "rb");
+    if(fp == NULL) {
+        error("cannot open \"%s\"", fname);
+        return NULL;
+    }
+
+    // a directory opens, but its size is not the size of any data
+    struct stat st;
+    if(fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        error("cannot read \"%s\"", fname);
+        fclose(fp);
+        return NULL;
+    }
+    long size = st.st_size;
+    if(size % sizeof(double) != 0) {
+        error("\"%s\" is %ld bytes, which is not a whole number of doubles", fname, size);
+        fclose(fp);
+        return NULL;
+    }
+
+    array_t* array = create_array(size / sizeof(double));
+    if(array != NULL && fread(array->data, sizeof(double), array->len, fp) != (size_t)array->len) {
+        error("cannot read \"%s\"", fname);
+        unref_array(array);
+        array = NULL;
+    }
+
+    fclose(fp);
+    return array;
+}
+
+/*
+ * Return true if the expression produces an array. Reductions produce a
+ * number even when their arguments are arrays. The answer for each node in
+ * the tree is kept in the node, so that planning the expression does not
+ * have to walk the tree again at every level.
+ */
+bool is_array_expr(ast_t* node) {
+
+    bool left = node->left != NULL && is_array_expr(node->left);
+    bool right = node->right != NULL && is_array_expr(node->right);
+    bool result = left || right;
+
+    switch(node->type) {
+        case VARIABLE_NODE: {
+                value_t val;
+                result = SYM_NO_ERROR == find_symbol(node->value.var->name, &val) &&
+                        val.type == ARRAY_VAL;
+            }
+            break;
+        case CALL_NODE:
+            switch(builtins[node->value.call->func].kind) {
+                case RANGE_FUNC:
+                case LOAD_FUNC:
+                    result = true;
+                    break;
+                case MATH_FUNC:
+                    break;
+                default:
+                    result = false;
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+
+    node->is_array = result;
+    return result;
+}
+
+static int add_step(plan_t* plan, step_kind_t kind) {
+
+    if(plan->len + 1 > plan->cap) {
+        plan->cap <<= 1;
+        plan->steps = REALLOC_LST(plan->steps, plan->cap, step_t);
+    }
+
+    step_t* step = &plan->steps[plan->len];
+    memset(step, 0, sizeof(step_t));
+    step->kind = kind;
+    step->a = -1;
+    step->b = -1;
+    if(kind != DATA_STEP)
+        step->buf = ALLOC_ALIGNED(ALIGN, BLOCK_SIZE * sizeof(double));
+
+    return plan->len++;
+}
+
+static void set_length(plan_t* plan, int64_t len) {
+
+    if(plan->length < 0)
+        plan->length = len;
+    else if(plan->length != len) {
+        error("array lengths %" PRId64 " and %" PRId64 " do not match", plan->length, len);
+        plan->failed = true;
+    }
+}
+
+static int add_data(plan_t* plan, array_t* array) {
+
+    int idx = add_step(plan, DATA_STEP);
+    plan->steps[idx].array = array;
+    set_length(plan, array->len);
+    return idx;
+}
+
+/*
+ * Evaluate a scalar argument of an array function.
+ */
+static double scalar_arg(plan_t* plan, ast_t* node) {
+
+    if(node->is_array) {
+        error("an array cannot be used here");
+        plan->failed = true;
+        return NAN;
+    }
+
+    return value_to_double(node->visit(node));
+}
+
+/*
+ * Add the steps for the node to the plan and return the step that has its
+ * value. is_array_expr() has to have been called on the tree first.
+ */
+static int add_node(plan_t* plan, ast_t* node) {
+
+    int idx;
+
+    if(!node->is_array) {
+        double val = value_to_double(node->visit(node));
+        idx = add_step(plan, FILL_STEP);
+        for(int i = 0; i < BLOCK_SIZE; i++)
+            plan->steps[idx].buf[i] = val;
+        return idx;
+    }
+
+    switch(node->type) {
+        case VARIABLE_NODE: {
+                value_t val;
+                find_symbol(node->value.var->name, &val);
+                return add_data(plan, ref_array(val.aval));
+            }
+        case UNARY_NODE: {
+                int a = add_node(plan, node->left);
+                idx = add_step(plan, (node->value.op->op == MINUS_OP)? NEG_STEP : ABS_STEP);
+                plan->steps[idx].a = a;
+                return idx;
+            }
+        case BINARY_NODE: {
+                int a = add_node(plan, node->left);
+                int b = add_node(plan, node->right);
+                idx = add_step(plan, BINARY_STEP);
+                plan->steps[idx].op = node->value.op->op;
+                plan->steps[idx].a = a;
+                plan->steps[idx].b = b;
+                return idx;
+            }
+        case CALL_NODE: {
+                int func = node->value.call->func;
+                switch(builtins[func].kind) {
+                    case MATH_FUNC: {
+                            int a = add_node(plan, node->left);
+                            int b = (node->right != NULL)? add_node(plan, node->right) : -1;
+                            idx = add_step(plan, CALL_STEP);
+                            plan->steps[idx].op = func;
+                            plan->steps[idx].a = a;
+                            plan->steps[idx].b = b;
+                            return idx;
+                        }
+                    case RANGE_FUNC: {
+                            double start = 0.0;
+                            double end = scalar_arg(plan, node->left);
+                            if(node->right != NULL) {
+                                start = end;
+                                end = scalar_arg(plan, node->right);
+                            }
+                            idx = add_step(plan, RANGE_STEP);
+                            plan->steps[idx].start = start;
+                            double len = (end > start)? ceil(end - start) : 0.0;
+                            if(len < MAX_RANGE)
+                                set_length(plan, (int64_t)len);
+                            else {
+                                error("range() of %g numbers is too long", len);
+                                plan->failed = true;
+                            }
+                            return idx;
+                        }
+                    case LOAD_FUNC: {
+                            array_t* array = load_array(node->value.call->str);
+                            if(array != NULL)
+                                return add_data(plan, array);
+                            break;
+                        }
+                    default:
+                        break;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    error("invalid array expression");
+    plan->failed = true;
+    return add_step(plan, FILL_STEP);
+}
+
+static void destroy_plan(plan_t* plan) {
+
+    for(int i = 0; i < plan->len; i++) {
+        if(plan->steps[i].array != NULL)
+            unref_array(plan->steps[i].array);
+        if(plan->steps[i].buf != NULL)
+            FREE(plan->steps[i].buf);
+    }
+
+    FREE(plan->steps);
+}
+
+static void init_plan(plan_t* plan) {
+
+    plan->len = 0;
+    plan->cap = 0x10;
+    plan->steps = ALLOC_LST(plan->cap, step_t);
+    plan->length = -1;
+    plan->failed = false;
+    plan->zero_divisor = false;
+}
+
+/*
+ * Apply the operator to n elements. Return true if a divisor was zero.
+ */
+static bool binary_kernel(op_type_t op, int n, const double* restrict a,
+                            const double* restrict b, double* restrict out) {
+
+    a = __builtin_assume_aligned(a, ALIGN);
+    b = __builtin_assume_aligned(b, ALIGN);
+    out = __builtin_assume_aligned(out, ALIGN);
+    bool zero = false;
+
+    switch(op) {
+        case PLUS_OP:
+            for(int i = 0; i < n; i++)
+                out[i] = a[i] + b[i];
+            break;
+        case MINUS_OP:
+            for(int i = 0; i < n; i++)
+                out[i] = a[i] - b[i];
+            break;
+        case STAR_OP:
+            for(int i = 0; i < n; i++)
+                out[i] = a[i] * b[i];
+            break;
+        case SLASH_OP:
+            for(int i = 0; i < n; i++) {
+                out[i] = a[i] / b[i];
+                zero |= (b[i] == 0.0);
+            }
+            break;
+        case PERCENT_OP:
+            for(int i = 0; i < n; i++) {
+                out[i] = fmod(a[i], b[i]);
+                zero |= (b[i] == 0.0);
+            }
+            break;
+        default:
+            break;
+    }
+
+    return zero;
+}
+
+/*
+ * Run every step of the plan for n elements starting at off. If root is not
+ * NULL, then the last step writes there instead of to its own buffer.
+ */
+static void run_block(plan_t* plan, int64_t off, int n, double* root) {
+
+    for(int i = 0; i < plan->len; i++) {
+        step_t* step = &plan->steps[i];
+        double* dst = (root != NULL && i == plan->len - 1)? root : step->buf;
+        const double* a = (step->a >= 0)? plan->steps[step->a].out : NULL;
+        const double* b = (step->b >= 0)? plan->steps[step->b].out : a;
+
+        switch(step->kind) {
+            case DATA_STEP:
+                step->out = step->array->data + off;
+                continue;
+            case FILL_STEP:
+                step->out = step->buf;
+                continue;
+            case RANGE_STEP:
+                for(int j = 0; j < n; j++)
+                    dst[j] = step->start + (double)(off + j);
+                break;
+            case NEG_STEP:
+                for(int j = 0; j < n; j++)
+                    dst[j] = -a[j];
+                break;
+            case ABS_STEP:
+                for(int j = 0; j < n; j++)
+                    dst[j] = fabs(a[j]);
+                break;
+            case BINARY_STEP:
+                if(binary_kernel(step->op, n, a, b, dst))
+                    plan->zero_divisor = true;
+                break;
+            case CALL_STEP:
+                builtins[step->op].batch(n, a, b, dst);
+                break;
+        }
+        step->out = dst;
+    }
+}
+
+/*
+ * Evaluate an expression that produces an array. The caller owns the
+ * reference to the result.
+ */
+value_t eval_array(ast_t* expr) {
+
+    msg(2, "Evaluate array expression");
+    plan_t plan;
+    init_plan(&plan);
+    is_array_expr(expr);
+    int root = add_node(&plan, expr);
+
+    array_t* result = NULL;
+    if(!plan.failed) {
+        if(plan.steps[root].kind == DATA_STEP)
+            result = ref_array(plan.steps[root].array);
+        else {
+            result = create_array(plan.length);
+            set_job_size(plan.length);
+            for(int64_t off = 0; result != NULL && off < plan.length; off += BLOCK_SIZE) {
+                int n = (plan.length - off < BLOCK_SIZE)? (int)(plan.length - off) : BLOCK_SIZE;
+                if(job_progress(n))
+                    break;
+                run_block(&plan, off, n, result->data + off);
+                if(plan.zero_divisor) {
+                    error("divide by zero");
+                    unref_array(result);
+                    result = NULL;
+                }
+            }
+        }
+    }
+
+    destroy_plan(&plan);
+    return (result != NULL)? ARRAY_VALUE(result) : NAN_VALUE;
+}
+
+/*
+ * Reduce the arguments of a call to sum(), min(), max(), dot() or len() to a
+ * number. The arguments are evaluated a block at a time, so an expression
+ * like sum(x * y) never makes the product array. A scalar argument acts like
+ * an array with one element.
+ */
+value_t reduce_array(ast_t* call) {
+
+    msg(2, "Reduce array expression");
+    builtin_kind_t kind = builtins[call->value.call->func].kind;
+    plan_t plan;
+    init_plan(&plan);
+
+    is_array_expr(call);
+    int a = add_node(&plan, call->left);
+    int b = (call->right != NULL)? add_node(&plan, call->right) : a;
+    int64_t length = (plan.length < 0)? 1 : plan.length;
+
+    if(plan.failed) {
+        destroy_plan(&plan);
+        return NAN_VALUE;
+    }
+
+    if(kind == LEN_FUNC) {
+        destroy_plan(&plan);
+        return INT_VALUE(length);
+    }
+
+    double acc = (kind == SUM_FUNC || kind == DOT_FUNC)? 0.0 :
+                    (kind == MIN_FUNC)? INFINITY : -INFINITY;
+    if(length == 0 && (kind == MIN_FUNC || kind == MAX_FUNC))
+        acc = NAN;
+
+    set_job_size(length);
+    for(int64_t off = 0; off < length; off += BLOCK_SIZE) {
+        int n = (length - off < BLOCK_SIZE)? (int)(length - off) : BLOCK_SIZE;
+        if(job_progress(n))
+            break;
+        run_block(&plan, off, n, NULL);
+        if(plan.zero_divisor) {
+            error("divide by zero");
+            acc = NAN;
+            break;
+        }
+        const double* va = plan.steps[a].out;
+        const double* vb = plan.steps[b].out;
+
+        switch(kind) {
+            case SUM_FUNC:
+                for(int i = 0; i < n; i++)
+                    acc += va[i];
+                break;
+            case DOT_FUNC:
+                for(int i = 0; i < n; i++)
+                    acc += va[i] * vb[i];
+                break;
+            case MIN_FUNC:
+                for(int i = 0; i < n; i++)
+                    acc = (va[i] < acc)? va[i] : acc;
+                break;
+            case MAX_FUNC:
+                for(int i = 0; i < n; i++)
+                    acc = (va[i] > acc)? va[i] : acc;
+                break;
+            default:
+                break;
+        }
+    }
+
+    destroy_plan(&plan);
+    return FLOAT_VALUE(acc);
+}
@@ -0,0 +1,34 @@
+/*
+ * Numeric arrays. An array is a reference counted, 64 byte aligned block of
+ * doubles. A variable can hold an array, and the operators and the math
+ * functions work on arrays element by element, with scalars broadcast to
+ * every element.
+ */
+#ifndef __ARRAY_H__
+#define __ARRAY_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "ast.h"
+#include "value.h"
+
+typedef struct _array_t_ {
+    int64_t len;
+    double* data;
+    atomic_int refs;
+} array_t;
+
+array_t* create_array(int64_t len);
+array_t* ref_array(array_t* array);
+void unref_array(array_t* array);
+void print_array(const char* prefix, array_t* array);
+
+void use_arrays(int delta);
+bool arrays_in_use(void);
+
+bool is_array_expr(ast_t* node);
+value_t eval_array(ast_t* expr);
+value_t reduce_array(ast_t* call);
+
+#endif
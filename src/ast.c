@@ -5,25 +5,41 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h> // for NAN definition
 
 #include "ast.h"
 #include "visit.h"
 #include "memory.h"
 #include "error.h"
 #include "symbols.h"
+#include "builtin.h"
+#include "array.h"
+#include "session.h"
 
 int serial_number = 0;
 
+// how many nodes of each shape have been given a special visitor
+typedef enum {
+    VAR_LIT_SHAPE,
+    LIT_VAR_SHAPE,
+    VAR_VAR_SHAPE,
+    NEG_VAR_SHAPE,
+    ASSIGN_VAR_LIT_SHAPE,
+    OTHER_SHAPE,    // binary nodes that kept the general visitor
+    NUM_SHAPES,
+} shape_t;
+
+static int shapes[NUM_SHAPES];
+
 static void print_node(ast_t* node) {
 
     switch(node->type) {
         case LITERAL_NODE:
-            printf("literal value: %0.3f\n", node->value.val->val);
+            print_value("literal value: ", node->value.val->val);
             break;
         case VARIABLE_NODE:
             find_symbol(node->value.var->name, &node->value.var->val);
-            printf("variable name: %s, value: %0.3f\n", node->value.var->name, node->value.var->val);
+            printf("variable name: %s, ", node->value.var->name);
+            print_value("value: ", node->value.var->val);
             break;
         case UNARY_NODE:
             printf("unary node op: %s\n", OP_TOSTR(node->value.op->op));
@@ -37,6 +53,9 @@ static void print_node(ast_t* node) {
         case PRINT_NODE:
             printf("print node\n");
             break;
+        case CALL_NODE:
+            printf("call node: %s\n", builtins[node->value.call->func].name);
+            break;
         default:
             error("unknown node type in print_node()");
     }
@@ -58,16 +77,103 @@ static void destroy_ast_node(ast_t* node) {
         case PRINT_NODE:
             FREE(node->value.op);
             break;
+        case CALL_NODE:
+            if(builtins[node->value.call->func].kind == RANGE_FUNC ||
+                    builtins[node->value.call->func].kind == LOAD_FUNC)
+                use_arrays(-1);
+            if(node->value.call->str != NULL)
+                FREE((void*)node->value.call->str);
+            FREE(node->value.call);
+            break;
         default:
             error("unknown node type in destroy_ast_node()");
     }
     FREE(node);
 }
 
+/*
+ * An operator or a pure function whose operands are all literals has a value
+ * and a type that are known as soon as it is built, so it is evaluated once
+ * here and replaced by a literal. A zero divisor is left for the evaluator to
+ * report. The time it takes is charged to the eval stage of a replay.
+ */
+static ast_t* fold_constant(ast_t* node) {
+
+    if(node->left == NULL || node->left->type != LITERAL_NODE)
+        return node;
+
+    if(node->right != NULL && node->right->type != LITERAL_NODE)
+        return node;
+
+    if(node->type == CALL_NODE) {
+        if(builtins[node->value.call->func].kind != MATH_FUNC ||
+                !builtins[node->value.call->func].pure)
+            return node;
+    }
+    else if(node->right != NULL &&
+            (node->value.op->op == SLASH_OP || node->value.op->op == PERCENT_OP) &&
+            value_is_zero(node->right->value.val->val))
+        return node;
+
+    msg(2, "Fold constant %s AST node", NT_TOSTR(node->type));
+    int64_t start = stage_timing? now_ns() : 0;
+    value_t val = node->visit(node);
+    if(stage_timing)
+        stage_ns[EVAL_STAGE] += now_ns() - start;
+    destroy_ast(node);
+    return ast_literal(val);
+}
+
+/*
+ * Most operators have a variable or a literal on one or both sides. Those
+ * nodes get a visitor that reads the operands straight out of the children,
+ * instead of calling the visitor of each child. The node type stays the same,
+ * so everything else that walks the tree sees no difference.
+ */
+static ast_t* specialize(ast_t* node) {
+
+    if(node->type == BINARY_NODE) {
+        node_type_t left = node->left->type;
+        node_type_t right = node->right->type;
+        if(left == VARIABLE_NODE && right == LITERAL_NODE) {
+            node->visit = visit_var_lit;
+            shapes[VAR_LIT_SHAPE]++;
+        }
+        else if(left == LITERAL_NODE && right == VARIABLE_NODE) {
+            node->visit = visit_lit_var;
+            shapes[LIT_VAR_SHAPE]++;
+        }
+        else if(left == VARIABLE_NODE && right == VARIABLE_NODE) {
+            node->visit = visit_var_var;
+            shapes[VAR_VAR_SHAPE]++;
+        }
+        else
+            shapes[OTHER_SHAPE]++;
+    }
+    else if(node->type == UNARY_NODE && node->value.op->op == MINUS_OP &&
+            node->left->type == VARIABLE_NODE) {
+        node->visit = visit_neg_var;
+        shapes[NEG_VAR_SHAPE]++;
+    }
+
+    return node;
+}
+
+/*
+ * Show how many nodes got a special visitor.
+ */
+void report_shapes() {
+
+    msg(1, "node shapes: var-lit %d, lit-var %d, var-var %d, -var %d, "
+            "var = var-lit %d, other binary %d", shapes[VAR_LIT_SHAPE],
+            shapes[LIT_VAR_SHAPE], shapes[VAR_VAR_SHAPE], shapes[NEG_VAR_SHAPE],
+            shapes[ASSIGN_VAR_LIT_SHAPE], shapes[OTHER_SHAPE]);
+}
+
 /*
  * Create a literal number.
  */
-ast_t* ast_literal(double val) {
+ast_t* ast_literal(value_t val) {
 
     msg(2, "Create a literal AST node");
     ast_t* node = ALLOC_DS(ast_t);
@@ -76,6 +182,7 @@ ast_t* ast_literal(double val) {
     node->visit = visit_literal;
     node->left = NULL;
     node->right = NULL;
+    node->size = 1;
 
     node->value.val = ALLOC_DS(literal_node_t);
     node->value.val->val = val;
@@ -95,9 +202,11 @@ ast_t* ast_variable(const char* name) {
     node->visit = visit_variable;
     node->left = NULL;
     node->right = NULL;
+    node->size = 1;
 
     node->value.var = ALLOC_DS(variable_node_t);
     node->value.var->name = name;
+    node->value.var->sym = find_handle(name);
     // note that value and other fields are completed when the tree is
     // evaluated.
 
@@ -116,11 +225,12 @@ ast_t* ast_unary(op_type_t op, ast_t* n) {
     node->visit = visit_unary;
     node->left = n;
     node->right = NULL;
+    node->size = n->size + 1;
 
     node->value.op = ALLOC_DS(operator_node_t);
     node->value.op->op = op;
 
-    return node;
+    return specialize(fold_constant(node));
 }
 
 /*
@@ -135,11 +245,12 @@ ast_t* ast_binary(op_type_t op, ast_t* left, ast_t* right) {
     node->visit = visit_binary;
     node->left = left;
     node->right = right;
+    node->size = left->size + right->size + 1;
 
     node->value.op = ALLOC_DS(operator_node_t);
     node->value.op->op = op;
 
-    return node;
+    return specialize(fold_constant(node));
 }
 
 /*
@@ -155,10 +266,16 @@ ast_t* ast_assign(const char* name, ast_t* tree) {
     node->visit = visit_assign;
     node->left = ast_variable(name);
     node->right = tree;
+    node->size = tree->size + 2;
 
     node->value.op = ALLOC_DS(operator_node_t);
     node->value.op->op = ASSIGN_OP;
 
+    if(tree->visit == visit_var_lit) {
+        node->visit = visit_assign_var_lit;
+        shapes[ASSIGN_VAR_LIT_SHAPE]++;
+    }
+
     return node;
 }
 
@@ -175,6 +292,7 @@ ast_t* ast_print(ast_t* tree) {
     node->visit = visit_print;
     node->left = tree;
     node->right = NULL;
+    node->size = tree->size + 1;
 
     node->value.op = ALLOC_DS(operator_node_t);
     node->value.op->op = PRINT_OP;
@@ -183,24 +301,72 @@ ast_t* ast_print(ast_t* tree) {
 }
 
 /*
- * Free all of the memory associated with the AST.
+ * Create a call to a built-in function. The second argument is NULL if the
+ * function only takes one.
  */
-void destroy_ast(ast_t* root) {
+ast_t* ast_call(int func, ast_t* arg1, ast_t* arg2) {
 
-    msg(1, "Destroy the AST");
-    if(root->left != NULL)
-        destroy_ast(root->left);
+    msg(2, "Create a call AST node");
+    ast_t* node = ALLOC_DS(ast_t);
+    node->type = CALL_NODE;
+    node->node_number = serial_number++;
+    node->visit = visit_call;
+    node->left = arg1;
+    node->right = arg2;
+    node->size = arg1->size + ((arg2 != NULL)? arg2->size : 0) + 1;
 
-    if(root->right != NULL)
-        destroy_ast(root->right);
+    node->value.call = ALLOC_DS(call_node_t);
+    node->value.call->func = func;
+    if(builtins[func].kind == RANGE_FUNC)
+        use_arrays(1);
 
-    destroy_ast_node(root);
+    return fold_constant(node);
+}
+
+/*
+ * Create a call to load(), which takes a file name instead of an expression.
+ * The name is owned by the node.
+ */
+ast_t* ast_load(int func, const char* fname) {
+
+    msg(2, "Create a load AST node");
+    ast_t* node = ALLOC_DS(ast_t);
+    node->type = CALL_NODE;
+    node->node_number = serial_number++;
+    node->visit = visit_call;
+    node->left = NULL;
+    node->right = NULL;
+    node->size = 1;
+
+    node->value.call = ALLOC_DS(call_node_t);
+    node->value.call->func = func;
+    node->value.call->str = fname;
+    use_arrays(1);
+
+    return node;
+}
+
+/*
+ * Free all of the memory associated with the AST. The left side is followed
+ * in a loop, so that a long chain such as a+b+c+... does not use up the stack.
+ */
+void destroy_ast(ast_t* root) {
+
+    while(root != NULL) {
+        msg(1, "Destroy the AST");
+        ast_t* left = root->left;
+        if(root->right != NULL)
+            destroy_ast(root->right);
+
+        destroy_ast_node(root);
+        root = left;
+    }
 }
 
 /*
  * Traverse the tree and return the numerical result of the expression.
  */
-double traverse_ast(ast_t* root) {
+value_t traverse_ast(ast_t* root) {
 
     msg(1, "Traverse the AST");
     int errs = get_errors();
@@ -208,7 +374,7 @@ double traverse_ast(ast_t* root) {
         return root->visit(root);
     else {
         printf("Errors: %d\n", errs);
-        return NAN;
+        return NAN_VALUE;
     }
 }
 
@@ -7,6 +7,8 @@
 
 #include <stdbool.h>
 
+#include "value.h"
+
 typedef enum {
     PLUS_OP,
     MINUS_OP,
@@ -33,6 +35,7 @@ typedef enum {
     BINARY_NODE,    // op
     ASSIGN_NODE,    // op
     PRINT_NODE,     // op
+    CALL_NODE,      // call
 } node_type_t;
 
 #define NT_TOSTR(n) (\
@@ -41,45 +44,59 @@ typedef enum {
     ((n) == LITERAL_NODE)? "LITERAL_NODE" : \
     ((n) == BINARY_NODE)? "BINARY_NODE" : \
     ((n) == ASSIGN_NODE)? "ASSIGN_NODE" : \
-    ((n) == PRINT_NODE)? "PRINT_NODE" : "UNKNOWN" )
+    ((n) == PRINT_NODE)? "PRINT_NODE" : \
+    ((n) == CALL_NODE)? "CALL_NODE" : "UNKNOWN" )
 
 typedef struct {
-    double val;
+    value_t val;
 } literal_node_t;
 
 typedef struct {
     bool is_assigned;
     const char* name;
-    double val;
+    value_t val;
+    struct _ste_t_* sym;    // symbol handle, or NULL if it did not exist yet
 } variable_node_t;
 
 typedef struct {
     op_type_t op;
-    double val;
+    value_t val;
 } operator_node_t;
 
+// the arguments of a call are the left and right children
+typedef struct {
+    int func;           // index into the builtin table
+    const char* str;    // file name for load(), else NULL
+} call_node_t;
+
 typedef struct _ast_t_ {
     node_type_t type;
     struct _ast_t_* left;
     struct _ast_t_* right;
-    double (*visit)(struct _ast_t_*);
+    value_t (*visit)(struct _ast_t_*);
     int node_number; // for dot generation
+    int size;        // number of nodes in this subtree
+    bool is_array;   // set by is_array_expr()
     union {
         literal_node_t* val;
         variable_node_t* var;
         operator_node_t* op;
+        call_node_t* call;
     } value;
 } ast_t;
 
-ast_t* ast_literal(double val);
+ast_t* ast_literal(value_t val);
 ast_t* ast_variable(const char* name);
 ast_t* ast_unary(op_type_t op, ast_t* node);
 ast_t* ast_binary(op_type_t op, ast_t* left, ast_t* right);
 ast_t* ast_assign(const char* name, ast_t* tree);
 ast_t* ast_print(ast_t* tree);
+ast_t* ast_call(int func, ast_t* arg1, ast_t* arg2);
+ast_t* ast_load(int func, const char* fname);
 
 void destroy_ast(ast_t* root);
-double traverse_ast(ast_t* root);
+void report_shapes();
+value_t traverse_ast(ast_t* root);
 void ast_to_dot(const char* fname);
 void dump_ast(ast_t* root);
 
@@ -0,0 +1,169 @@
+/*
+ * The built-in math functions. The scalar versions are used by the
+ * evaluator. The batch versions are plain loops over restrict pointers, with
+ * no calls through the table inside the loop, so the compiler is free to
+ * vectorize them.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "builtin.h"
+
+#define FUNC1(n, f) \
+    static double n##_func(double a, double b) { \
+        (void)b; \
+        return f(a); \
+    } \
+    static void n##_batch(int len, const double* restrict a, \
+                          const double* restrict b, double* restrict out) { \
+        (void)b; \
+        for(int i = 0; i < len; i++) \
+            out[i] = f(a[i]); \
+    }
+
+#define FUNC2(n, f) \
+    static double n##_func(double a, double b) { \
+        return f(a, b); \
+    } \
+    static void n##_batch(int len, const double* restrict a, \
+                          const double* restrict b, double* restrict out) { \
+        for(int i = 0; i < len; i++) \
+            out[i] = f(a[i], b[i]); \
+    }
+
+// partial derivative with respect to the only argument
+#define DERIV1(n, e) \
+    static void n##_deriv(double a, double b, double* da, double* db) { \
+        (void)a; \
+        (void)b; \
+        *da = (e); \
+        *db = 0.0; \
+    }
+
+// partial derivatives with respect to both arguments
+#define DERIV2(n, ea, eb) \
+    static void n##_deriv(double a, double b, double* da, double* db) { \
+        *da = (ea); \
+        *db = (eb); \
+    }
+
+FUNC1(sqrt, sqrt)
+FUNC1(cbrt, cbrt)
+FUNC1(exp, exp)
+FUNC1(log, log)
+FUNC1(log10, log10)
+FUNC1(log2, log2)
+FUNC1(sin, sin)
+FUNC1(cos, cos)
+FUNC1(tan, tan)
+FUNC1(asin, asin)
+FUNC1(acos, acos)
+FUNC1(atan, atan)
+FUNC1(sinh, sinh)
+FUNC1(cosh, cosh)
+FUNC1(tanh, tanh)
+FUNC1(floor, floor)
+FUNC1(ceil, ceil)
+FUNC1(round, round)
+FUNC1(abs, fabs)
+FUNC2(pow, pow)
+FUNC2(atan2, atan2)
+FUNC2(hypot, hypot)
+FUNC2(fmod, fmod)
+
+DERIV1(sqrt, 0.5 / sqrt(a))
+DERIV1(cbrt, 1.0 / (3.0 * cbrt(a) * cbrt(a)))
+DERIV1(exp, exp(a))
+DERIV1(log, 1.0 / a)
+DERIV1(log10, 1.0 / (a * M_LN10))
+DERIV1(log2, 1.0 / (a * M_LN2))
+DERIV1(sin, cos(a))
+DERIV1(cos, -sin(a))
+DERIV1(tan, 1.0 / (cos(a) * cos(a)))
+DERIV1(asin, 1.0 / sqrt(1.0 - a * a))
+DERIV1(acos, -1.0 / sqrt(1.0 - a * a))
+DERIV1(atan, 1.0 / (1.0 + a * a))
+DERIV1(sinh, cosh(a))
+DERIV1(cosh, sinh(a))
+DERIV1(tanh, 1.0 - tanh(a) * tanh(a))
+DERIV1(floor, 0.0)
+DERIV1(ceil, 0.0)
+DERIV1(round, 0.0)
+DERIV1(abs, (a > 0.0) - (a < 0.0))
+DERIV2(pow, b * pow(a, b - 1.0), (a == 0.0)? 0.0 : pow(a, b) * log(a))
+DERIV2(atan2, b / (a * a + b * b), -a / (a * a + b * b))
+DERIV2(hypot, a / hypot(a, b), b / hypot(a, b))
+DERIV2(fmod, 1.0, -trunc(a / b))
+
+#define ENTRY(n, a) { #n, MATH_FUNC, a, true, n##_func, n##_batch, n##_deriv }
+#define ARRAY_ENTRY(n, k, a, p) { #n, k, a, p, NULL, NULL, NULL }
+
+const builtin_t builtins[] = {
+    ENTRY(sqrt, 1),
+    ENTRY(cbrt, 1),
+    ENTRY(exp, 1),
+    ENTRY(log, 1),
+    ENTRY(log10, 1),
+    ENTRY(log2, 1),
+    ENTRY(sin, 1),
+    ENTRY(cos, 1),
+    ENTRY(tan, 1),
+    ENTRY(asin, 1),
+    ENTRY(acos, 1),
+    ENTRY(atan, 1),
+    ENTRY(sinh, 1),
+    ENTRY(cosh, 1),
+    ENTRY(tanh, 1),
+    ENTRY(floor, 1),
+    ENTRY(ceil, 1),
+    ENTRY(round, 1),
+    ENTRY(abs, 1),
+    ENTRY(pow, 2),
+    ENTRY(atan2, 2),
+    ENTRY(hypot, 2),
+    ENTRY(fmod, 2),
+    ARRAY_ENTRY(sum, SUM_FUNC, 1, true),
+    ARRAY_ENTRY(min, MIN_FUNC, 1, true),
+    ARRAY_ENTRY(max, MAX_FUNC, 1, true),
+    ARRAY_ENTRY(dot, DOT_FUNC, 2, true),
+    ARRAY_ENTRY(len, LEN_FUNC, 1, true),
+    ARRAY_ENTRY(range, RANGE_FUNC, 1, true),
+    ARRAY_ENTRY(range, RANGE_FUNC, 2, true),
+    ARRAY_ENTRY(load, LOAD_FUNC, 1, false),
+    { NULL, MATH_FUNC, 0, false, NULL, NULL, NULL }
+};
+
+/*
+ * Return the index of the function with the name and number of arguments, or
+ * -1 if there is not one.
+ */
+int find_builtin(const char* name, int nargs) {
+
+    for(int i = 0; builtins[i].name != NULL; i++)
+        if(builtins[i].nargs == nargs && strcmp(builtins[i].name, name) == 0)
+            return i;
+
+    return -1;
+}
+
+/*
+ * Print the names of the functions for the help text.
+ */
+void list_builtins() {
+
+    int col = 0;
+    for(int i = 0; builtins[i].name != NULL; i++) {
+        const char* args = (builtins[i].nargs == 1)? "x" : "x,y";
+        if(builtins[i].kind == LOAD_FUNC)
+            args = "\"file\"";
+        col += printf("%s%s(%s)", (col == 0)? "  " : " ", builtins[i].name, args);
+        if(col > 64) {
+            printf("\n");
+            col = 0;
+        }
+    }
+
+    if(col > 0)
+        printf("\n");
+}
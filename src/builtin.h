@@ -0,0 +1,47 @@
+/*
+ * Table of the built-in math functions. A call is resolved to an index in the
+ * table when it is parsed, so evaluating it is an indexed call instead of a
+ * lookup by name. Each function also has a batch version that runs over
+ * arrays of arguments in one call, and the partial derivatives of the
+ * function with respect to each argument.
+ *
+ * The array functions are in the same table so that they are resolved the
+ * same way, but they have no scalar versions. The array evaluator handles
+ * them by their kind.
+ */
+#ifndef __BUILTIN_H__
+#define __BUILTIN_H__
+
+#include <stdbool.h>
+
+typedef double (*builtin_func_t)(double a, double b);
+typedef void (*builtin_batch_t)(int n, const double* a, const double* b, double* out);
+typedef void (*builtin_deriv_t)(double a, double b, double* da, double* db);
+
+typedef enum {
+    MATH_FUNC,      // scalar function, applied elementwise to arrays
+    SUM_FUNC,       // reductions of an array to a scalar
+    MIN_FUNC,
+    MAX_FUNC,
+    DOT_FUNC,
+    LEN_FUNC,
+    RANGE_FUNC,     // functions that create an array
+    LOAD_FUNC,
+} builtin_kind_t;
+
+typedef struct {
+    const char* name;
+    builtin_kind_t kind;
+    int nargs;
+    bool pure;  // same arguments always give the same result
+    builtin_func_t func;
+    builtin_batch_t batch;
+    builtin_deriv_t deriv;  // partial derivatives for automatic differentiation
+} builtin_t;
+
+extern const builtin_t builtins[];
+
+int find_builtin(const char* name, int nargs);
+void list_builtins();
+
+#endif
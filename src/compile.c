@@ -0,0 +1,619 @@
+/*
+ * Compile a whole program into register code and optimize it.
+ *
+ * As the statements are lowered, every computation is given a value number
+ * made from its operator and its operand registers. A computation that was
+ * already done anywhere earlier in the program reuses the register that holds
+ * it, and one whose operands are constants is done here instead. An
+ * assignment emits no code at all. It only makes the variable name the
+ * register that holds its new value.
+ *
+ * When the whole program has been lowered, everything that does not reach a
+ * print, a final variable value or a possible divide by zero is removed. That
+ * takes care of stores that are overwritten before they are read and of
+ * variables that are only used as temporaries.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "ast.h"
+#include "compile.h"
+#include "memory.h"
+#include "error.h"
+#include "symbols.h"
+#include "builtin.h"
+
+// the left side of a chain this long is kept on the stack by lower_expr()
+#define SPINE_SIZE  8
+
+typedef struct {
+    int op;
+    int64_t x;
+    int64_t y;
+    int reg;    // -1 if the slot is empty
+} vn_entry_t;
+
+struct _compiler_t_ {
+    code_t* code;
+    int* var_reg;       // register holding each name, or -1
+    int* reg_def;       // instruction that defines each register
+    int reg_cap;
+    vn_entry_t* vn;
+    int vn_len;
+    int vn_cap;
+    int* name_hash;     // index into code->names, or -1
+    int name_hash_cap;
+};
+
+static uint64_t hash_key(int op, int64_t x, int64_t y) {
+
+    uint64_t h = (uint64_t)op;
+    h = (h ^ (uint64_t)x) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 32) ^ (uint64_t)y) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 29)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 32);
+}
+
+static uint64_t hash_str(const char* str) {
+
+    uint64_t h = 0xCBF29CE484222325ULL;
+    while(*str != '\0')
+        h = (h ^ (unsigned char)*str++) * 0x100000001B3ULL;
+    return h ^ (h >> 29);
+}
+
+/*
+ * Find the slot for the key, which is either the matching entry or the empty
+ * slot where it belongs.
+ */
+static vn_entry_t* find_vn(compiler_t* c, int op, int64_t x, int64_t y) {
+
+    int mask = c->vn_cap - 1;
+    int idx = (int)(hash_key(op, x, y) & mask);
+    while(c->vn[idx].reg >= 0) {
+        vn_entry_t* e = &c->vn[idx];
+        if(e->op == op && e->x == x && e->y == y)
+            break;
+        idx = (idx + 1) & mask;
+    }
+
+    return &c->vn[idx];
+}
+
+static void add_vn(compiler_t* c, int op, int64_t x, int64_t y, int reg) {
+
+    if((c->vn_len + 1) * 2 > c->vn_cap) {
+        vn_entry_t* old = c->vn;
+        int old_cap = c->vn_cap;
+        c->vn_cap <<= 1;
+        c->vn = ALLOC_LST(c->vn_cap, vn_entry_t);
+        for(int i = 0; i < c->vn_cap; i++)
+            c->vn[i].reg = -1;
+        for(int i = 0; i < old_cap; i++)
+            if(old[i].reg >= 0)
+                *find_vn(c, old[i].op, old[i].x, old[i].y) = old[i];
+        FREE(old);
+    }
+
+    vn_entry_t* e = find_vn(c, op, x, y);
+    e->op = op;
+    e->x = x;
+    e->y = y;
+    e->reg = reg;
+    c->vn_len++;
+}
+
+static int* find_name(compiler_t* c, const char* name) {
+
+    int mask = c->name_hash_cap - 1;
+    int idx = (int)(hash_str(name) & mask);
+    while(c->name_hash[idx] >= 0) {
+        if(strcmp(c->code->names[c->name_hash[idx]], name) == 0)
+            break;
+        idx = (idx + 1) & mask;
+    }
+
+    return &c->name_hash[idx];
+}
+
+/*
+ * Return the index of the name in the name table, adding it if needed.
+ */
+static int intern_name(compiler_t* c, const char* name) {
+
+    code_t* code = c->code;
+    int* slot = find_name(c, name);
+    if(*slot >= 0)
+        return *slot;
+
+    if(code->nnames + 1 > code->name_cap) {
+        code->name_cap <<= 1;
+        code->names = REALLOC_LST(code->names, code->name_cap, const char*);
+        c->var_reg = REALLOC_LST(c->var_reg, code->name_cap, int);
+    }
+
+    if((code->nnames + 1) * 2 > c->name_hash_cap) {
+        FREE(c->name_hash);
+        c->name_hash_cap <<= 1;
+        c->name_hash = ALLOC_LST(c->name_hash_cap, int);
+        memset(c->name_hash, 0xff, c->name_hash_cap * sizeof(int));
+        for(int i = 0; i < code->nnames; i++)
+            *find_name(c, code->names[i]) = i;
+        slot = find_name(c, name);
+    }
+
+    code->names[code->nnames] = STRDUP(name);
+    c->var_reg[code->nnames] = -1;
+    *slot = code->nnames;
+    return code->nnames++;
+}
+
+/*
+ * Add an instruction and return the register that it writes.
+ */
+static int emit(compiler_t* c, opcode_t op, int a, int b, int func) {
+
+    code_t* code = c->code;
+    if(code->len + 1 > code->cap) {
+        code->cap <<= 1;
+        code->code = REALLOC_LST(code->code, code->cap, instr_t);
+    }
+
+    int dst = -1;
+    if(op != PRINT_INS) {
+        if(code->nregs + 1 > c->reg_cap) {
+            c->reg_cap <<= 1;
+            c->reg_def = REALLOC_LST(c->reg_def, c->reg_cap, int);
+        }
+        dst = code->nregs++;
+        c->reg_def[dst] = code->len;
+    }
+
+    instr_t* ins = &code->code[code->len++];
+    ins->op = op;
+    ins->dst = dst;
+    ins->a = a;
+    ins->b = b;
+    ins->func = func;
+
+    return dst;
+}
+
+/*
+ * Return the constant held by the register, or -1 if it is not a constant.
+ */
+static int const_of(compiler_t* c, int reg) {
+
+    instr_t* ins = &c->code->code[c->reg_def[reg]];
+    return (ins->op == CONST_INS)? ins->a : -1;
+}
+
+static int lower_const(compiler_t* c, value_t val) {
+
+    int64_t bits;
+    if(val.type == INT_VAL || val.type == DEC_VAL)
+        bits = val.ival;
+    else
+        memcpy(&bits, &val.fval, sizeof(bits));
+
+    // a decimal is numbered with its scale, so 1.5 and 0.15 are different
+    int type = val.type | (((val.type == DEC_VAL)? val.scale : 0) << 8);
+    vn_entry_t* e = find_vn(c, CONST_INS, type, bits);
+    if(e->reg >= 0)
+        return e->reg;
+
+    code_t* code = c->code;
+    if(code->nconsts + 1 > code->const_cap) {
+        code->const_cap <<= 1;
+        code->consts = REALLOC_LST(code->consts, code->const_cap, value_t);
+    }
+    code->consts[code->nconsts] = val;
+
+    int reg = emit(c, CONST_INS, code->nconsts++, -1, 0);
+    add_vn(c, CONST_INS, type, bits, reg);
+    return reg;
+}
+
+/*
+ * Do the arithmetic for an instruction. This is shared by the constant folder
+ * and the interpreter so they always agree.
+ */
+static value_t apply_op(opcode_t op, value_t a, value_t b) {
+
+    switch(op) {
+        case NEG_INS: return value_neg(a);
+        case ABS_INS: return value_abs(a);
+        case ADD_INS: return value_add(a, b);
+        case SUB_INS: return value_sub(a, b);
+        case MUL_INS: return value_mul(a, b);
+        case DIV_INS:
+            if(value_is_zero(b)) {
+                error("divide by zero");
+                return NAN_VALUE;
+            }
+            return value_div(a, b);
+        case MOD_INS:
+            if(value_is_zero(b)) {
+                error("divide by zero");
+                return NAN_VALUE;
+            }
+            return value_mod(a, b);
+        default:
+            error("invalid instruction in apply_op()");
+            return NAN_VALUE;
+    }
+}
+
+static int lower_op(compiler_t* c, opcode_t op, int a, int b) {
+
+    int ca = const_of(c, a);
+    int cb = (b >= 0)? const_of(c, b) : -2;
+    if(ca >= 0 && cb != -1) {
+        value_t right = (cb >= 0)? c->code->consts[cb] : NAN_VALUE;
+        if(!((op == DIV_INS || op == MOD_INS) && value_is_zero(right)))
+            return lower_const(c, apply_op(op, c->code->consts[ca], right));
+    }
+
+    vn_entry_t* e = find_vn(c, op, a, b);
+    if(e->reg >= 0)
+        return e->reg;
+
+    int reg = emit(c, op, a, b, 0);
+    add_vn(c, op, a, b, reg);
+    return reg;
+}
+
+/*
+ * A call is numbered like any other operation, with the function index
+ * folded into the operator.
+ */
+static int lower_call(compiler_t* c, int func, int a, int b) {
+
+    int ca = const_of(c, a);
+    int cb = (b >= 0)? const_of(c, b) : -2;
+    if(builtins[func].pure && ca >= 0 && cb != -1) {
+        double right = (cb >= 0)? value_to_double(c->code->consts[cb]) : 0.0;
+        return lower_const(c, FLOAT_VALUE(builtins[func].func(
+                            value_to_double(c->code->consts[ca]), right)));
+    }
+
+    int op = CALL_INS | (func << 8);
+    vn_entry_t* e = find_vn(c, op, a, b);
+    if(e->reg >= 0 && builtins[func].pure)
+        return e->reg;
+
+    int reg = emit(c, CALL_INS, a, b, func);
+    add_vn(c, op, a, b, reg);
+    return reg;
+}
+
+static opcode_t opcode_of(op_type_t op, bool unary) {
+
+    switch(op) {
+        case PLUS_OP:    return unary? ABS_INS : ADD_INS;
+        case MINUS_OP:   return unary? NEG_INS : SUB_INS;
+        case STAR_OP:    return MUL_INS;
+        case SLASH_OP:   return DIV_INS;
+        case PERCENT_OP: return MOD_INS;
+        default:
+            error("invalid operator in opcode_of(): %s", OP_TOSTR(op));
+            return NEG_INS;
+    }
+}
+
+static int lower_expr(compiler_t* c, ast_t* node);
+
+/*
+ * Lower an expression that is not an operator and return the register that
+ * holds its value.
+ */
+static int lower_operand(compiler_t* c, ast_t* node) {
+
+    switch(node->type) {
+        case LITERAL_NODE:
+            return lower_const(c, node->value.val->val);
+        case VARIABLE_NODE: {
+                int name = intern_name(c, node->value.var->name);
+                if(c->var_reg[name] < 0)
+                    c->var_reg[name] = emit(c, LOAD_INS, name, -1, 0);
+                return c->var_reg[name];
+            }
+        case CALL_NODE: {
+                if(builtins[node->value.call->func].kind != MATH_FUNC) {
+                    error("%s() cannot be compiled", builtins[node->value.call->func].name);
+                    return lower_const(c, NAN_VALUE);
+                }
+                int left = lower_expr(c, node->left);
+                int right = (node->right != NULL)? lower_expr(c, node->right) : -1;
+                return lower_call(c, node->value.call->func, left, right);
+            }
+        default:
+            error("unknown node type in lower_expr()");
+            return lower_const(c, NAN_VALUE);
+    }
+}
+
+/*
+ * Lower an expression and return the register that holds its value. The
+ * operators down the left side of a chain such as a+b+c+... are gathered
+ * first and lowered from the bottom up in a loop, so a long chain does not
+ * use up the stack.
+ */
+static int lower_expr(compiler_t* c, ast_t* node) {
+
+    ast_t* stack[SPINE_SIZE];
+    ast_t** spine = stack;
+    int cap = SPINE_SIZE;
+    int len = 0;
+
+    for(; node->type == UNARY_NODE || node->type == BINARY_NODE; node = node->left) {
+        if(len + 1 > cap) {
+            cap <<= 1;
+            if(spine == stack) {
+                spine = ALLOC_LST(cap, ast_t*);
+                memcpy(spine, stack, sizeof(stack));
+            }
+            else
+                spine = REALLOC_LST(spine, cap, ast_t*);
+        }
+        spine[len++] = node;
+    }
+
+    int reg = lower_operand(c, node);
+    while(len > 0) {
+        node = spine[--len];
+        if(node->type == UNARY_NODE)
+            reg = lower_op(c, opcode_of(node->value.op->op, true), reg, -1);
+        else {
+            int right = lower_expr(c, node->right);
+            reg = lower_op(c, opcode_of(node->value.op->op, false), reg, right);
+        }
+    }
+
+    if(spine != stack)
+        FREE(spine);
+    return reg;
+}
+
+static void lower_statement(compiler_t* c, ast_t* stmt) {
+
+    if(stmt->value.op->op == PRINT_OP)
+        emit(c, PRINT_INS, lower_expr(c, stmt->left), -1, 0);
+    else {
+        int reg = lower_expr(c, stmt->right);
+        int name = intern_name(c, stmt->left->value.var->name);
+        c->var_reg[name] = reg;
+    }
+}
+
+/*
+ * Mark what the output of the program depends on, then drop everything else
+ * and renumber the registers that are left.
+ */
+static void remove_dead_code(compiler_t* c) {
+
+    code_t* code = c->code;
+    bool* live = ALLOC_LST(code->len + 1, bool);
+
+    for(int i = 0; i < code->nstores; i++)
+        live[c->reg_def[code->stores[i].reg]] = true;
+
+    for(int i = code->len - 1; i >= 0; i--) {
+        instr_t* ins = &code->code[i];
+        switch(ins->op) {
+            case PRINT_INS:
+                live[i] = true;
+                break;
+            case DIV_INS:
+            case MOD_INS:
+                if(const_of(c, ins->b) < 0 ||
+                        value_is_zero(code->consts[const_of(c, ins->b)]))
+                    live[i] = true;
+                break;
+            default:
+                break;
+        }
+
+        if(live[i] && ins->op != CONST_INS && ins->op != LOAD_INS) {
+            live[c->reg_def[ins->a]] = true;
+            if(ins->b >= 0)
+                live[c->reg_def[ins->b]] = true;
+        }
+    }
+
+    int* new_reg = ALLOC_LST(code->nregs + 1, int);
+    int len = 0;
+    int nregs = 0;
+    for(int i = 0; i < code->len; i++) {
+        if(!live[i])
+            continue;
+
+        instr_t ins = code->code[i];
+        if(ins.op != CONST_INS && ins.op != LOAD_INS) {
+            ins.a = new_reg[ins.a];
+            if(ins.b >= 0)
+                ins.b = new_reg[ins.b];
+        }
+        if(ins.dst >= 0) {
+            new_reg[ins.dst] = nregs;
+            ins.dst = nregs++;
+        }
+        code->code[len++] = ins;
+    }
+
+    for(int i = 0; i < code->nstores; i++)
+        code->stores[i].reg = new_reg[code->stores[i].reg];
+
+    msg(1, "compiled %d instructions, %d removed, %d registers",
+                code->len, code->len - len, nregs);
+    code->len = len;
+    code->nregs = nregs;
+
+    FREE(new_reg);
+    FREE(live);
+}
+
+/*
+ * Start compiling a new program.
+ */
+compiler_t* create_compiler() {
+
+    msg(1, "Create the compiler");
+    code_t* code = ALLOC_DS(code_t);
+    code->cap = 0x100;
+    code->code = ALLOC_LST(code->cap, instr_t);
+    code->const_cap = 0x40;
+    code->consts = ALLOC_LST(code->const_cap, value_t);
+    code->name_cap = 0x40;
+    code->names = ALLOC_LST(code->name_cap, const char*);
+
+    compiler_t* c = ALLOC_DS(compiler_t);
+    c->code = code;
+    c->var_reg = ALLOC_LST(code->name_cap, int);
+    c->reg_cap = 0x100;
+    c->reg_def = ALLOC_LST(c->reg_cap, int);
+    c->vn_len = 0;
+    c->vn_cap = 0x100;
+    c->vn = ALLOC_LST(c->vn_cap, vn_entry_t);
+    for(int i = 0; i < c->vn_cap; i++)
+        c->vn[i].reg = -1;
+    c->name_hash_cap = 0x80;
+    c->name_hash = ALLOC_LST(c->name_hash_cap, int);
+    memset(c->name_hash, 0xff, c->name_hash_cap * sizeof(int));
+
+    return c;
+}
+
+/*
+ * Lower the statement onto the end of the program. The AST is not needed
+ * after this returns.
+ */
+void compile_statement(compiler_t* c, ast_t* stmt) {
+
+    lower_statement(c, stmt);
+}
+
+/*
+ * Optimize the whole program, free the compiler, and return the code.
+ */
+code_t* finish_compiler(compiler_t* c) {
+
+    msg(1, "Finish compiling the program");
+    code_t* code = c->code;
+
+    // every variable the program assigned gets its final value written back
+    code->stores = ALLOC_LST(code->nnames + 1, store_t);
+    for(int i = 0; i < code->nnames; i++) {
+        int reg = c->var_reg[i];
+        instr_t* def = (reg >= 0)? &code->code[c->reg_def[reg]] : NULL;
+        if(def != NULL && !(def->op == LOAD_INS && def->a == i)) {
+            code->stores[code->nstores].name = i;
+            code->stores[code->nstores].reg = reg;
+            code->nstores++;
+        }
+    }
+
+    remove_dead_code(c);
+
+    FREE(c->var_reg);
+    FREE(c->reg_def);
+    FREE(c->vn);
+    FREE(c->name_hash);
+    FREE(c);
+
+    return code;
+}
+
+/*
+ * Compile a program that has already been parsed into register code.
+ */
+code_t* compile_program(program_t* prog) {
+
+    compiler_t* c = create_compiler();
+    for(int i = 0; i < prog->len; i++)
+        compile_statement(c, prog->list[i]);
+
+    return finish_compiler(c);
+}
+
+/*
+ * Run the register code, then write the final variable values back to the
+ * symbol table.
+ */
+void run_code(code_t* code) {
+
+    msg(1, "Run the compiled program");
+    value_t* regs = ALLOC_LST(code->nregs + 1, value_t);
+
+    for(int i = 0; i < code->len; i++) {
+        instr_t* ins = &code->code[i];
+        switch(ins->op) {
+            case CONST_INS:
+                regs[ins->dst] = code->consts[ins->a];
+                break;
+            case LOAD_INS:
+                if(SYM_NO_ERROR != find_symbol(code->names[ins->a], &regs[ins->dst])) {
+                    error("symbol \"%s\" is not defined", code->names[ins->a]);
+                    regs[ins->dst] = NAN_VALUE;
+                }
+                else if(regs[ins->dst].type == ARRAY_VAL) {
+                    error("array \"%s\" cannot be used in compiled code", code->names[ins->a]);
+                    regs[ins->dst] = NAN_VALUE;
+                }
+                break;
+            case PRINT_INS:
+                print_value("Result: ", regs[ins->a]);
+                break;
+            case NEG_INS:
+            case ABS_INS:
+                regs[ins->dst] = apply_op(ins->op, regs[ins->a], NAN_VALUE);
+                break;
+            case CALL_INS:
+                regs[ins->dst] = FLOAT_VALUE(builtins[ins->func].func(
+                            value_to_double(regs[ins->a]),
+                            (ins->b >= 0)? value_to_double(regs[ins->b]) : 0.0));
+                break;
+            default:
+                regs[ins->dst] = apply_op(ins->op, regs[ins->a], regs[ins->b]);
+                break;
+        }
+    }
+
+    // code loaded from an image runs before the symbols exist
+    for(int i = 0; i < code->nstores; i++) {
+        const char* name = code->names[code->stores[i].name];
+        symbols_error_t err = assign_symbol(name, regs[code->stores[i].reg]);
+        if(err == SYM_NOT_FOUND) {
+            add_symbol(name);
+            err = assign_symbol(name, regs[code->stores[i].reg]);
+        }
+        if(err == SYM_READ_ONLY)
+            error("symbol \"%s\" is read only", name);
+    }
+
+    FREE(regs);
+}
+
+/*
+ * Free the register code.
+ */
+void destroy_code(code_t* code) {
+
+    // the arrays of an image are in the mapping, except for the names
+    if(code->map != NULL) {
+        munmap(code->map, code->map_size);
+        FREE(code->names);
+        FREE(code);
+        return;
+    }
+
+    for(int i = 0; i < code->nnames; i++)
+        FREE((void*)code->names[i]);
+
+    FREE(code->names);
+    FREE(code->consts);
+    FREE(code->code);
+    FREE(code->stores);
+    FREE(code);
+}
@@ -0,0 +1,71 @@
+/*
+ * A whole program can be compiled into a list of instructions that work on
+ * numbered virtual registers. Each register is written exactly once, so
+ * variables are only names for registers while the program runs and the
+ * symbol table is read and written only at the start and the end.
+ */
+#ifndef __COMPILE_H__
+#define __COMPILE_H__
+
+#include "value.h"
+#include "program.h"
+
+typedef enum {
+    CONST_INS,  // dst = consts[a]
+    LOAD_INS,   // dst = symbol names[a]
+    NEG_INS,    // dst = -a
+    ABS_INS,    // dst = +a
+    ADD_INS,    // dst = a + b
+    SUB_INS,    // dst = a - b
+    MUL_INS,    // dst = a * b
+    DIV_INS,    // dst = a / b
+    MOD_INS,    // dst = a % b
+    PRINT_INS,  // print a
+    CALL_INS,   // dst = builtins[func](a, b)
+} opcode_t;
+
+// unused operands are -1
+typedef struct {
+    opcode_t op;
+    int dst;
+    int a;
+    int b;
+    int func;
+} instr_t;
+
+/*
+ * The final value of a variable that is written back to the symbol table when
+ * the program finishes.
+ */
+typedef struct {
+    int name;
+    int reg;
+} store_t;
+
+typedef struct {
+    instr_t* code;
+    int len;
+    int cap;
+    value_t* consts;
+    int nconsts;
+    int const_cap;
+    const char** names;
+    int nnames;
+    int name_cap;
+    store_t* stores;
+    int nstores;
+    int nregs;
+    void* map;          // the image the arrays point into, or NULL
+    size_t map_size;
+} code_t;
+
+typedef struct _compiler_t_ compiler_t;
+
+compiler_t* create_compiler();
+void compile_statement(compiler_t* c, ast_t* stmt);
+code_t* finish_compiler(compiler_t* c);
+code_t* compile_program(program_t* prog);
+void run_code(code_t* code);
+void destroy_code(code_t* code);
+
+#endif
@@ -2,7 +2,10 @@
 #include <stdio.h>
 #include <stdarg.h>
 
-static int errors = 0;
+// Each thread keeps its own count, so statements that run at the same time
+// do not see each other's errors. The pool moves the errors of a task to the
+// thread that joins it, see pool.c.
+static __thread int errors = 0;
 
 int get_errors() {
     return errors;
@@ -12,6 +15,10 @@ void reset_errors() {
     errors = 0;
 }
 
+void add_errors(int count) {
+    errors += count;
+}
+
 void error(const char* fmt, ...) {
 
     printf("syntax error: ");
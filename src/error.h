@@ -5,6 +5,7 @@
 void error(const char* fmt, ...);
 int get_errors();
 void reset_errors();
+void add_errors(int count);
 void msg(int level, const char* fmt, ...);
 
 #endif
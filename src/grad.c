@@ -0,0 +1,227 @@
+/*
+ * Forward mode automatic differentiation using dual numbers. Every value in
+ * the expression is paired with a vector that holds its partial derivative
+ * with respect to each requested variable, and every operation applies its
+ * derivative rule to the vectors as it applies itself to the values. One pass
+ * over the tree gives the value and all of the partials, where finite
+ * differences need one extra evaluation for each variable.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "ast.h"
+#include "grad.h"
+#include "memory.h"
+#include "error.h"
+#include "symbols.h"
+#include "builtin.h"
+#include "job.h"
+
+typedef struct {
+    grad_t* grad;
+    int n;          // number of partials in each vector
+    double* stack;  // vectors for the right side of binary nodes
+    int top;
+} dual_t;
+
+/*
+ * Create a gradient statement for the expression. The variables are added
+ * with add_grad_name().
+ */
+grad_t* create_grad(ast_t* expr) {
+
+    grad_t* grad = ALLOC_DS(grad_t);
+    grad->expr = expr;
+    grad->cap = 0x08;
+    grad->names = ALLOC_LST(grad->cap, const char*);
+
+    return grad;
+}
+
+void add_grad_name(grad_t* grad, const char* name) {
+
+    if(grad->len + 1 > grad->cap) {
+        grad->cap <<= 1;
+        grad->names = REALLOC_LST(grad->names, grad->cap, const char*);
+    }
+
+    grad->names[grad->len++] = name;
+}
+
+void destroy_grad(grad_t* grad) {
+
+    for(int i = 0; i < grad->len; i++)
+        FREE((void*)grad->names[i]);
+
+    destroy_ast(grad->expr);
+    FREE(grad->names);
+    FREE(grad);
+}
+
+static int tree_height(ast_t* node) {
+
+    int left = (node->left != NULL)? tree_height(node->left) : 0;
+    int right = (node->right != NULL)? tree_height(node->right) : 0;
+    return ((left > right)? left : right) + 1;
+}
+
+/*
+ * Evaluate the node and put its partial derivatives in d.
+ */
+static double eval_dual(dual_t* ctx, ast_t* node, double* d) {
+
+    int n = ctx->n;
+    if(job_cancelled())
+        return NAN;
+
+    switch(node->type) {
+        case LITERAL_NODE:
+            memset(d, 0, n * sizeof(double));
+            return value_to_double(node->value.val->val);
+
+        case VARIABLE_NODE: {
+                value_t val;
+                const char* name = node->value.var->name;
+                if(SYM_NO_ERROR != find_symbol(name, &val)) {
+                    error("symbol \"%s\" is not defined", name);
+                    val = NAN_VALUE;
+                }
+                for(int k = 0; k < n; k++)
+                    d[k] = (strcmp(ctx->grad->names[k], name) == 0)? 1.0 : 0.0;
+                return value_to_double(val);
+            }
+
+        case UNARY_NODE: {
+                double val = eval_dual(ctx, node->left, d);
+                double scale = (node->value.op->op == MINUS_OP)? -1.0 :
+                                    (val > 0.0) - (val < 0.0); // abs
+                for(int k = 0; k < n; k++)
+                    d[k] *= scale;
+                return (node->value.op->op == MINUS_OP)? -val : fabs(val);
+            }
+
+        case BINARY_NODE: {
+                double* dr = &ctx->stack[ctx->top];
+                ctx->top += n;
+                double l = eval_dual(ctx, node->left, d);
+                double r = eval_dual(ctx, node->right, dr);
+                double val;
+
+                switch(node->value.op->op) {
+                    case PLUS_OP:
+                        for(int k = 0; k < n; k++)
+                            d[k] += dr[k];
+                        val = l + r;
+                        break;
+                    case MINUS_OP:
+                        for(int k = 0; k < n; k++)
+                            d[k] -= dr[k];
+                        val = l - r;
+                        break;
+                    case STAR_OP:
+                        for(int k = 0; k < n; k++)
+                            d[k] = d[k] * r + l * dr[k];
+                        val = l * r;
+                        break;
+                    case SLASH_OP:
+                        if(r == 0.0) {
+                            error("divide by zero");
+                            val = NAN;
+                            break;
+                        }
+                        for(int k = 0; k < n; k++)
+                            d[k] = (d[k] * r - l * dr[k]) / (r * r);
+                        val = l / r;
+                        break;
+                    case PERCENT_OP:
+                        if(r == 0.0) {
+                            error("divide by zero");
+                            val = NAN;
+                            break;
+                        }
+                        for(int k = 0; k < n; k++)
+                            d[k] -= trunc(l / r) * dr[k];
+                        val = fmod(l, r);
+                        break;
+                    default:
+                        error("invalid binary node type: %s", OP_TOSTR(node->value.op->op));
+                        val = NAN;
+                        break;
+                }
+
+                ctx->top -= n;
+                return val;
+            }
+
+        case CALL_NODE: {
+                const builtin_t* func = &builtins[node->value.call->func];
+                if(func->kind != MATH_FUNC) {
+                    error("cannot differentiate %s()", func->name);
+                    return NAN;
+                }
+
+                double* db = &ctx->stack[ctx->top];
+                ctx->top += n;
+                double a = eval_dual(ctx, node->left, d);
+                double b = 0.0;
+                if(node->right != NULL)
+                    b = eval_dual(ctx, node->right, db);
+                else
+                    memset(db, 0, n * sizeof(double));
+
+                double pa, pb;
+                func->deriv(a, b, &pa, &pb);
+                for(int k = 0; k < n; k++)
+                    d[k] = pa * d[k] + ((pb != 0.0)? pb * db[k] : 0.0);
+
+                ctx->top -= n;
+                return func->func(a, b);
+            }
+
+        default:
+            error("cannot differentiate %s", NT_TOSTR(node->type));
+            return NAN;
+    }
+}
+
+/*
+ * Evaluate the expression and print its value followed by the partial
+ * derivative with respect to each variable.
+ */
+void run_grad(grad_t* grad) {
+
+    msg(1, "Differentiate the AST");
+    for(int i = 0; i < grad->len; i++)
+        if(SYM_NOT_FOUND == find_symbol(grad->names[i], NULL))
+            error("symbol \"%s\" is not found", grad->names[i]);
+
+    if(get_errors() != 0) {
+        printf("Errors: %d\n", get_errors());
+        return;
+    }
+
+    dual_t ctx;
+    ctx.grad = grad;
+    ctx.n = grad->len;
+    ctx.top = 0;
+    ctx.stack = ALLOC_LST((size_t)tree_height(grad->expr) * ctx.n + 1, double);
+    double* d = ALLOC_LST(ctx.n + 1, double);
+
+    set_job_size(grad->expr->size);
+    double val = eval_dual(&ctx, grad->expr, d);
+    if(atomic_load(&job_cancel)) {
+        FREE(d);
+        FREE(ctx.stack);
+        return;
+    }
+
+    print_value("Result: ", FLOAT_VALUE(val));
+    for(int i = 0; i < grad->len; i++) {
+        printf("d/d%s: ", grad->names[i]);
+        print_value("", FLOAT_VALUE(d[i]));
+    }
+
+    FREE(d);
+    FREE(ctx.stack);
+}
@@ -0,0 +1,23 @@
+/*
+ * Forward mode automatic differentiation. The expression is evaluated once
+ * with every value carrying its partial derivatives with respect to each of
+ * the requested variables.
+ */
+#ifndef __GRAD_H__
+#define __GRAD_H__
+
+#include "ast.h"
+
+typedef struct {
+    ast_t* expr;
+    const char** names;
+    int len;
+    int cap;
+} grad_t;
+
+grad_t* create_grad(ast_t* expr);
+void add_grad_name(grad_t* grad, const char* name);
+void run_grad(grad_t* grad);
+void destroy_grad(grad_t* grad);
+
+#endif
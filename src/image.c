@@ -0,0 +1,357 @@
+/*
+ * Program images.
+ *
+ * An image is a header followed by the instructions, the constants, the
+ * stores, a table of name offsets and the names themselves. Every section
+ * starts on an 8 byte boundary and is referred to by its offset from the
+ * start of the file, so the file can be mapped anywhere. The sections are laid
+ * out the same as the arrays in a code_t, so a loaded image is run from the
+ * mapping. Only the table of name pointers is built when it is loaded.
+ *
+ * The header has its own checksum, which is checked first, so a file that is
+ * not an image or that is from a different version is turned away without
+ * reading the rest of it. Then the checksum of the body is checked, and every
+ * instruction is checked to refer to registers, constants, names and
+ * functions that exist.
+ *
+ * The header also has the decimal places that the script was compiled with,
+ * since the constants were folded with them, and a loaded image runs with
+ * the same places.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "builtin.h"
+#include "memory.h"
+#include "error.h"
+
+#define IMAGE_MAGIC     "CALCIMG"
+#define IMAGE_VERSION   2
+#define BYTE_ORDER_MARK 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t builtins;      // fingerprint of the builtin table
+    uint32_t header_sum;    // checksum of the header with this set to zero
+    uint64_t body_sum;      // checksum of everything after the header
+    uint64_t size;          // size of the whole file
+    int32_t ncode;
+    int32_t nconsts;
+    int32_t nstores;
+    int32_t nnames;
+    int32_t nregs;
+    uint32_t code_off;
+    uint32_t const_off;
+    uint32_t store_off;
+    uint32_t name_off;      // nnames offsets into the strings
+    uint32_t str_off;
+    uint32_t str_size;
+    int32_t scale;          // decimal places that the constants were folded with
+} header_t;
+
+// the sections are used in place, so the layout of these has to be fixed
+_Static_assert(sizeof(instr_t) == 20, "instr_t is not 5 ints");
+_Static_assert(sizeof(value_t) == 16, "value_t is not 16 bytes");
+_Static_assert(sizeof(store_t) == 8, "store_t is not 2 ints");
+
+#define ALIGN8(n)   (((n) + 7) & ~(size_t)7)
+
+static uint64_t checksum(const void* data, size_t len) {
+
+    const unsigned char* p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 32;
+    }
+
+    for(; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+/*
+ * Calls are stored as indexes into the builtin table, so an image is only
+ * good for a build with the same table.
+ */
+static uint32_t builtin_fingerprint() {
+
+    uint64_t h = 0;
+    for(int i = 0; builtins[i].name != NULL; i++) {
+        h = h * 31 + checksum(builtins[i].name, strlen(builtins[i].name));
+        h = h * 31 + builtins[i].nargs * 16 + builtins[i].kind;
+    }
+
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint32_t header_checksum(header_t* h) {
+
+    header_t tmp = *h;
+    tmp.header_sum = 0;
+    uint64_t sum = checksum(&tmp, sizeof(tmp));
+    return (uint32_t)(sum ^ (sum >> 32));
+}
+
+/*
+ * Write the code to the file. The image is written to a temporary file that
+ * is renamed when it is complete, so a failed write never leaves half of an
+ * image behind.
+ */
+bool save_image(code_t* code, const char* fname) {
+
+    header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    h.version = IMAGE_VERSION;
+    h.byte_order = BYTE_ORDER_MARK;
+    h.builtins = builtin_fingerprint();
+    h.ncode = code->len;
+    h.nconsts = code->nconsts;
+    h.nstores = code->nstores;
+    h.nnames = code->nnames;
+    h.nregs = code->nregs;
+    h.scale = decimal_scale;
+
+    for(int i = 0; i < code->nnames; i++)
+        h.str_size += strlen(code->names[i]) + 1;
+
+    size_t off = ALIGN8(sizeof(header_t));
+    h.code_off = off;
+    off = ALIGN8(off + (size_t)code->len * sizeof(instr_t));
+    h.const_off = off;
+    off = ALIGN8(off + (size_t)code->nconsts * sizeof(value_t));
+    h.store_off = off;
+    off = ALIGN8(off + (size_t)code->nstores * sizeof(store_t));
+    h.name_off = off;
+    off = ALIGN8(off + (size_t)code->nnames * sizeof(uint32_t));
+    h.str_off = off;
+    off = ALIGN8(off + h.str_size);
+    h.size = off;
+
+    if(off > UINT32_MAX) {
+        fprintf(stderr, "program is too big for an image: %s\n", fname);
+        return false;
+    }
+
+    char* buf = ALLOC(off);     // cleared, so the padding is zero
+    memcpy(buf + h.code_off, code->code, (size_t)code->len * sizeof(instr_t));
+    value_t* consts = (value_t*)(buf + h.const_off);
+    for(int i = 0; i < code->nconsts; i++) {
+        consts[i].type = code->consts[i].type;
+        consts[i].scale = code->consts[i].scale;
+        consts[i].ival = code->consts[i].ival;  // copies the whole union
+    }
+    memcpy(buf + h.store_off, code->stores, (size_t)code->nstores * sizeof(store_t));
+
+    uint32_t* names = (uint32_t*)(buf + h.name_off);
+    uint32_t pos = 0;
+    for(int i = 0; i < code->nnames; i++) {
+        size_t len = strlen(code->names[i]) + 1;
+        names[i] = pos;
+        memcpy(buf + h.str_off + pos, code->names[i], len);
+        pos += len;
+    }
+
+    h.body_sum = checksum(buf + sizeof(header_t), off - sizeof(header_t));
+    h.header_sum = header_checksum(&h);
+    memcpy(buf, &h, sizeof(h));
+
+    char* tmp = ALLOC(strlen(fname) + 5);
+    sprintf(tmp, "%s.tmp", fname);
+    FILE* fp = fopen(tmp, "wb");
+    bool ok = fp != NULL && fwrite(buf, 1, off, fp) == off;
+    if(fp != NULL)
+        ok = (fclose(fp) == 0) && ok;
+    if(ok)
+        ok = rename(tmp, fname) == 0;
+    else
+        remove(tmp);
+
+    if(!ok)
+        fprintf(stderr, "cannot write image: %s\n", fname);
+
+    FREE(tmp);
+    FREE(buf);
+    return ok;
+}
+
+static bool bad_reg(code_t* code, int reg) {
+
+    return reg < 0 || reg >= code->nregs;
+}
+
+/*
+ * Check that every instruction refers to things that exist, so a bad image
+ * cannot make run_code() read outside of its arrays.
+ */
+static bool check_code(code_t* code) {
+
+    int nfuncs = 0;
+    while(builtins[nfuncs].name != NULL)
+        nfuncs++;
+
+    for(int i = 0; i < code->len; i++) {
+        instr_t* ins = &code->code[i];
+        switch(ins->op) {
+            case CONST_INS:
+                if(bad_reg(code, ins->dst) || ins->a < 0 || ins->a >= code->nconsts)
+                    return false;
+                break;
+            case LOAD_INS:
+                if(bad_reg(code, ins->dst) || ins->a < 0 || ins->a >= code->nnames)
+                    return false;
+                break;
+            case PRINT_INS:
+                if(bad_reg(code, ins->a))
+                    return false;
+                break;
+            case NEG_INS:
+            case ABS_INS:
+                if(bad_reg(code, ins->dst) || bad_reg(code, ins->a))
+                    return false;
+                break;
+            case CALL_INS:
+                if(ins->func < 0 || ins->func >= nfuncs ||
+                        builtins[ins->func].kind != MATH_FUNC ||
+                        (builtins[ins->func].nargs == 2 && bad_reg(code, ins->b)) ||
+                        (builtins[ins->func].nargs == 1 && ins->b != -1))
+                    return false;
+                if(bad_reg(code, ins->dst) || bad_reg(code, ins->a))
+                    return false;
+                break;
+            case ADD_INS:
+            case SUB_INS:
+            case MUL_INS:
+            case DIV_INS:
+            case MOD_INS:
+                if(bad_reg(code, ins->dst) || bad_reg(code, ins->a) || bad_reg(code, ins->b))
+                    return false;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    for(int i = 0; i < code->nconsts; i++) {
+        value_t* val = &code->consts[i];
+        if(val->type != INT_VAL && val->type != FLOAT_VAL && val->type != DEC_VAL)
+            return false;
+        if(val->type == DEC_VAL && (val->scale < 0 || val->scale > MAX_SCALE))
+            return false;
+    }
+
+    for(int i = 0; i < code->nstores; i++)
+        if(code->stores[i].name < 0 || code->stores[i].name >= code->nnames ||
+                bad_reg(code, code->stores[i].reg))
+            return false;
+
+    return true;
+}
+
+static bool bad_section(header_t* h, uint32_t off, int32_t count, size_t size) {
+
+    return count < 0 || (off & 7) != 0 || off < sizeof(header_t) ||
+            off + (uint64_t)count * size > h->size;
+}
+
+/*
+ * Map the image into memory and return it as code that can be run. Return
+ * NULL if the file is not a good image for this build.
+ */
+code_t* load_image(const char* fname) {
+
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "cannot open image: %s\n", fname);
+        return NULL;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header_t)) {
+        fprintf(stderr, "not an image: %s\n", fname);
+        close(fd);
+        return NULL;
+    }
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "cannot map image: %s\n", fname);
+        return NULL;
+    }
+
+    header_t* h = (header_t*)map;
+    const char* why = NULL;
+    if(memcmp(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0)
+        why = "not an image";
+    else if(h->header_sum != header_checksum(h))
+        why = "the header is corrupt";
+    else if(h->version != IMAGE_VERSION || h->byte_order != BYTE_ORDER_MARK)
+        why = "the image is from a different version or machine";
+    else if(h->builtins != builtin_fingerprint())
+        why = "the image was made with different built-in functions";
+    else if(h->size != (uint64_t)st.st_size)
+        why = "the file is the wrong size";
+    else if(bad_section(h, h->code_off, h->ncode, sizeof(instr_t)) ||
+            bad_section(h, h->const_off, h->nconsts, sizeof(value_t)) ||
+            bad_section(h, h->store_off, h->nstores, sizeof(store_t)) ||
+            bad_section(h, h->name_off, h->nnames, sizeof(uint32_t)) ||
+            bad_section(h, h->str_off, h->str_size, 1) || h->nregs < 0 ||
+            h->scale < 0 || h->scale > MAX_SCALE ||
+            (h->str_size > 0 && map[h->str_off + h->str_size - 1] != '\0'))
+        why = "the sections are bad";
+    else if(h->body_sum != checksum(map + sizeof(header_t), h->size - sizeof(header_t)))
+        why = "the body is corrupt";
+
+    if(why != NULL) {
+        fprintf(stderr, "cannot load image %s: %s\n", fname, why);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    code_t* code = ALLOC_DS(code_t);
+    code->map = map;
+    code->map_size = st.st_size;
+    code->code = (instr_t*)(map + h->code_off);
+    code->len = h->ncode;
+    code->consts = (value_t*)(map + h->const_off);
+    code->nconsts = h->nconsts;
+    code->stores = (store_t*)(map + h->store_off);
+    code->nstores = h->nstores;
+    code->nregs = h->nregs;
+    code->nnames = h->nnames;
+    code->names = ALLOC_LST(h->nnames + 1, const char*);
+
+    uint32_t* names = (uint32_t*)(map + h->name_off);
+    bool ok = true;
+    for(int i = 0; i < h->nnames; i++) {
+        ok = ok && names[i] < h->str_size;
+        code->names[i] = ok? map + h->str_off + names[i] : "";
+    }
+
+    if(!ok || !check_code(code)) {
+        fprintf(stderr, "cannot load image %s: the code is bad\n", fname);
+        destroy_code(code);
+        return NULL;
+    }
+
+    // the program runs with the places it was compiled with
+    decimal_scale = h->scale;
+    msg(1, "Loaded %d instructions from %s", code->len, fname);
+    return code;
+}
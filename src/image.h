@@ -0,0 +1,16 @@
+/*
+ * Program images. A compiled program can be saved to a file and run later
+ * without scanning or parsing the script again. The file holds no pointers,
+ * so it is mapped into memory and run where it lies.
+ */
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdbool.h>
+
+#include "compile.h"
+
+bool save_image(code_t* code, const char* fname);
+code_t* load_image(const char* fname);
+
+#endif
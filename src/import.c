@@ -0,0 +1,309 @@
+/*
+ * Bulk import.
+ *
+ * The file is mapped into memory and cut into chunks at line boundaries.
+ * Each chunk is read by a task on the thread pool into its own list of names
+ * and values, with the names still pointing into the mapping. The lists are
+ * then joined in file order and given to add_symbols() in one batch, which
+ * assigns the names that exist and adds the new ones to the tree all at once.
+ *
+ * A line is a name, then = or a comma, then a number. Spaces around each
+ * part, blank lines and lines that start with # are skipped, and so is a
+ * CSV header. The name of a command is not a name, because a variable with
+ * that name could not be used.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "import.h"
+#include "symbols.h"
+#include "pool.h"
+#include "memory.h"
+#include "error.h"
+
+#define MIN_CHUNK   (256 * 1024)
+#define MAX_NUMBER  64
+
+typedef struct {
+    const char* start;
+    const char* end;
+    sym_entry_t* list;
+    long len;
+    long cap;
+    long lines;
+    long bad;
+    long first_bad;     // line in the chunk, counting from 0
+    const char* bad_line;
+} chunk_t;
+
+// the words that scan.l reads as commands
+static const char* keywords[] = {
+    "print", "p", "symt", "s", "stats", "import", "decimal", "help", "h",
+    "quit", "q", "verbose", "v", "grad", "wrt", NULL
+};
+
+static bool is_keyword(const char* name, int len) {
+
+    for(int i = 0; keywords[i] != NULL; i++)
+        if(strncmp(keywords[i], name, len) == 0 && keywords[i][len] == '\0')
+            return true;
+    return false;
+}
+
+static bool is_name_char(char c) {
+
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char* skip_space(const char* p, const char* end) {
+
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    return p;
+}
+
+/*
+ * Read the number in p to end. Up to 18 digits with no point or exponent is
+ * an integer. Anything else is a decimal in decimal mode if it fits, and is
+ * read with strtod() if not.
+ */
+static bool parse_value(const char* p, const char* end, value_t* val) {
+
+    char buf[MAX_NUMBER + 1];
+    int len = end - p;
+    if(len <= 0 || len > MAX_NUMBER)
+        return false;
+
+    const char* s = p;
+    bool neg = false;
+    if(*s == '-' || *s == '+')
+        neg = (*s++ == '-');
+
+    uint64_t n = 0;
+    const char* digits = s;
+    while(s < end && *s >= '0' && *s <= '9' && s - digits < 18)
+        n = n * 10 + (*s++ - '0');
+
+    if(s == end && s > digits) {
+        *val = INT_VALUE(neg? -(int64_t)n : (int64_t)n);
+        return true;
+    }
+
+    if(decimal_scale > 0 && parse_decimal(p, len, decimal_scale, val))
+        return true;
+
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    char* after;
+    double d = strtod(buf, &after);
+    if(after != buf + len)
+        return false;
+
+    *val = FLOAT_VALUE(d);
+    return true;
+}
+
+/*
+ * Read one line. Return false if it is not a name and a value.
+ */
+static bool read_line(chunk_t* chunk, const char* p, const char* end) {
+
+    p = skip_space(p, end);
+    if(p == end || *p == '#')
+        return true;
+
+    const char* name = p;
+    if(*p >= '0' && *p <= '9')
+        return false;
+    while(p < end && is_name_char(*p))
+        p++;
+    int name_len = p - name;
+
+    p = skip_space(p, end);
+    if(name_len == 0 || p == end || (*p != '=' && *p != ',') || is_keyword(name, name_len))
+        return false;
+
+    p = skip_space(p + 1, end);
+    while(end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        end--;
+
+    value_t val;
+    if(!parse_value(p, end, &val))
+        return false;
+
+    if(chunk->len + 1 > chunk->cap) {
+        chunk->cap = (chunk->cap == 0)? 0x1000 : chunk->cap << 1;
+        chunk->list = (chunk->list == NULL)? ALLOC_LST(chunk->cap, sym_entry_t) :
+                                    REALLOC_LST(chunk->list, chunk->cap, sym_entry_t);
+    }
+
+    chunk->list[chunk->len].name = name;
+    chunk->list[chunk->len].len = name_len;
+    chunk->list[chunk->len].val = val;
+    chunk->len++;
+    return true;
+}
+
+static void read_chunk(task_t* task) {
+
+    chunk_t* chunk = task->data;
+    const char* p = chunk->start;
+
+    while(p < chunk->end) {
+        const char* nl = memchr(p, '\n', chunk->end - p);
+        const char* eol = (nl != NULL)? nl : chunk->end;
+
+        if(!read_line(chunk, p, eol)) {
+            if(chunk->bad == 0) {
+                chunk->first_bad = chunk->lines;
+                chunk->bad_line = p;
+            }
+            chunk->bad++;
+        }
+
+        chunk->lines++;
+        p = eol + 1;
+    }
+}
+
+/*
+ * Import the file into the symbol table. Return the number of values that
+ * were read, or -1 if the file could not be read.
+ */
+long import_file(const char* fname) {
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        error("cannot open \"%s\"", fname);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    if(size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    const char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        error("cannot map \"%s\"", fname);
+        return -1;
+    }
+    madvise((void*)map, size, MADV_SEQUENTIAL);
+
+    // a CSV header is a first line that is not a name and a number and has
+    // a comma in it
+    const char* end = map + size;
+    const char* first = map;
+    long line = 0;
+    {
+        chunk_t head = { 0 };
+        const char* nl = memchr(map, '\n', size);
+        if(!read_line(&head, map, (nl != NULL)? nl : end) &&
+                memchr(map, ',', ((nl != NULL)? nl : end) - map) != NULL) {
+            first = (nl != NULL)? nl + 1 : end;
+            line = 1;
+        }
+        if(head.list != NULL)
+            FREE(head.list);
+    }
+
+    int num_chunks = pool_is_running()? pool_threads() * 4 : 1;
+    if(num_chunks > (end - first) / MIN_CHUNK)
+        num_chunks = (end - first) / MIN_CHUNK;
+    if(num_chunks < 1)
+        num_chunks = 1;
+
+    // each chunk starts after the end of a line
+    chunk_t* chunks = ALLOC_LST(num_chunks, chunk_t);
+    task_t* tasks = ALLOC_LST(num_chunks, task_t);
+    for(int i = 0; i < num_chunks; i++) {
+        const char* p = first + (end - first) * i / num_chunks;
+        if(i > 0) {
+            const char* nl = memchr(p - 1, '\n', end - (p - 1));
+            p = (nl != NULL)? nl + 1 : end;
+        }
+        chunks[i].start = p;
+        if(i > 0)
+            chunks[i - 1].end = p;
+        tasks[i].func = read_chunk;
+        tasks[i].data = &chunks[i];
+    }
+    chunks[num_chunks - 1].end = end;
+
+    for(int i = 1; i < num_chunks; i++)
+        fork_task(&tasks[i]);
+    read_chunk(&tasks[0]);
+    for(int i = num_chunks - 1; i > 0; i--)
+        join_task(&tasks[i]);
+
+    long count = 0;
+    long bad = 0;
+    for(int i = 0; i < num_chunks; i++) {
+        if(chunks[i].bad > 0) {
+            if(bad == 0) {
+                const char* p = chunks[i].bad_line;
+                const char* nl = memchr(p, '\n', end - p);
+                int len = ((nl != NULL)? nl : end) - p;
+                error("%s: line %ld is not a name and a number: %.*s", fname,
+                        line + chunks[i].first_bad + 1, (len > 60)? 60 : len, p);
+            }
+            bad += chunks[i].bad;
+        }
+        line += chunks[i].lines;
+        count += chunks[i].len;
+    }
+    if(bad > 1)
+        error("%s: %ld lines could not be read", fname, bad);
+
+    // join the lists in file order, so the last value of a name wins
+    sym_entry_t* list = chunks[0].list;
+    if(num_chunks > 1) {
+        list = ALLOC_LST(count + 1, sym_entry_t);
+        long pos = 0;
+        for(int i = 0; i < num_chunks; i++) {
+            if(chunks[i].len > 0)
+                memcpy(list + pos, chunks[i].list, chunks[i].len * sizeof(sym_entry_t));
+            pos += chunks[i].len;
+            if(chunks[i].list != NULL)
+                FREE(chunks[i].list);
+        }
+    }
+
+    // the symbol table counts its names with an int
+    if(count > INT_MAX) {
+        error("%s: %ld values are more than can be imported at once", fname, count);
+        count = 0;
+    }
+
+    int locked = (count > 0)? add_symbols(list, (int)count) : 0;
+    if(locked > 0)
+        error("%s: %d values were not assigned because the names are read only", fname, locked);
+
+    if(list != NULL)
+        FREE(list);
+    FREE(tasks);
+    FREE(chunks);
+    munmap((void*)map, size);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    printf("Imported %ld values from %s in %0.3fs\n", count, fname, secs);
+
+    return count;
+}
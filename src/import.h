@@ -0,0 +1,11 @@
+/*
+ * Bulk import of variables. A file of name=value lines, or of name,value
+ * lines as in a two column CSV file, is read straight into the symbol table
+ * without going through the parser.
+ */
+#ifndef __IMPORT_H__
+#define __IMPORT_H__
+
+long import_file(const char* fname);
+
+#endif
@@ -0,0 +1,235 @@
+/*
+ * The job queue and the worker thread that runs it. The readline loop puts
+ * each line on the queue and waits a short time for it. If the line takes
+ * longer, the prompt comes back and the job keeps running in the background.
+ *
+ * A cancel only sets a flag. The visitors see it at the next node and return
+ * without doing any more work, and an assignment whose value was cancelled
+ * is not made, so the symbol table is never left half updated.
+ *
+ * Lines are numbered as they are submitted and run in that order, so the
+ * worker knows the number of each line it takes. A ctrl-C marks every line
+ * submitted so far to be dropped. A line typed after it has a larger number,
+ * so a ctrl-C that comes just as the last job finishes cannot drop it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "job.h"
+#include "memory.h"
+#include "error.h"
+
+atomic_bool job_cancel = false;
+__thread int job_ticks = 0;
+
+static atomic_llong visited = 0;    // work done by the running job
+static atomic_llong job_size = 0;   // work in the running statement
+static atomic_llong submitted = 0;  // lines put on the queue
+static atomic_llong finished = 0;   // lines run or dropped
+static atomic_llong drop_upto = 0;  // lines up to this number are dropped
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static char** queue = NULL;
+static int head = 0;
+static int tail = 0;
+static int cap = 0;
+static char* running = NULL;        // the line being run, or NULL
+static struct timespec started;
+static void (*run_line)(const char*) = NULL;
+
+/*
+ * Add the counted visits of this thread to the total.
+ */
+void add_ticks() {
+
+    atomic_fetch_add_explicit(&visited, job_ticks, memory_order_relaxed);
+    job_ticks = 0;
+}
+
+/*
+ * Set the amount of work in the statement that is about to run.
+ */
+void set_job_size(int64_t size) {
+
+    atomic_store(&visited, 0);
+    atomic_store(&job_size, size);
+}
+
+static void* worker(void* arg) {
+
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for(;;) {
+        while(head == tail)
+            pthread_cond_wait(&work_cond, &lock);
+
+        // The flag is cleared before the drop mark is read. A ctrl-C that
+        // sets the mark too late to be seen here sets the flag after this,
+        // so the line is cancelled either way.
+        char* line = queue[head++];
+        atomic_store(&job_cancel, false);
+        if(atomic_load(&finished) + 1 <= atomic_load(&drop_upto)) {
+            FREE(line);
+            atomic_fetch_add(&finished, 1);
+            if(head == tail)
+                pthread_cond_broadcast(&idle_cond);
+            continue;
+        }
+
+        running = line;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        set_job_size(0);
+        pthread_mutex_unlock(&lock);
+
+        run_line(running);
+        add_ticks();
+        if(atomic_load(&job_cancel))
+            printf("Cancelled\n");
+        fflush(stdout);
+
+        pthread_mutex_lock(&lock);
+        FREE(running);
+        running = NULL;
+        atomic_fetch_add(&finished, 1);
+        if(head == tail)
+            pthread_cond_broadcast(&idle_cond);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the thread that runs the jobs. Each job is passed to run.
+ */
+void start_worker(void (*run)(const char*)) {
+
+    pthread_t thread;
+
+    sigset_t mask, old;
+
+    run_line = run;
+    cap = 0x10;
+    queue = ALLOC_LST(cap, char*);
+
+    // the worker inherits a mask that blocks SIGINT, so ctrl-C always goes
+    // to the readline thread
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    if(pthread_create(&thread, NULL, worker, NULL) != 0) {
+        fprintf(stderr, "cannot start the worker thread\n");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(thread);
+}
+
+/*
+ * Put a copy of the line on the queue.
+ */
+void submit_job(const char* line) {
+
+    pthread_mutex_lock(&lock);
+    if(head == tail)
+        head = tail = 0;
+    if(tail + 1 > cap) {
+        cap <<= 1;
+        queue = REALLOC_LST(queue, cap, char*);
+    }
+    queue[tail++] = STRDUP(line);
+    atomic_fetch_add(&submitted, 1);
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Wait for every job to finish, or for msecs milliseconds if msecs is not
+ * negative. Return true if there is nothing left to run.
+ */
+bool wait_jobs(int msecs) {
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += msecs / 1000;
+    until.tv_nsec += (msecs % 1000) * 1000000L;
+    if(until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&lock);
+    int err = 0;
+    while((running != NULL || head != tail) && err == 0) {
+        if(msecs < 0)
+            pthread_cond_wait(&idle_cond, &lock);
+        else
+            err = pthread_cond_timedwait(&idle_cond, &lock, &until);
+    }
+    bool idle = (running == NULL && head == tail);
+    pthread_mutex_unlock(&lock);
+
+    return idle;
+}
+
+/*
+ * Cancel the running job and drop the ones that have not started.
+ */
+void cancel_job() {
+
+    pthread_mutex_lock(&lock);
+    atomic_store(&drop_upto, atomic_load(&submitted));
+    if(running != NULL)
+        atomic_store(&job_cancel, true);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The same as cancel_job(), but only uses atomics, so it can be called from
+ * a signal handler. The worker drops the queued lines as it comes to them.
+ * Return false if there was nothing to cancel.
+ */
+bool interrupt_job() {
+
+    long long last = atomic_load(&submitted);
+    if(atomic_load(&finished) >= last)
+        return false;
+
+    atomic_store(&drop_upto, last);
+    atomic_store(&job_cancel, true);
+    return true;
+}
+
+/*
+ * Show the running job with the time it has taken and how much of the
+ * statement has been done.
+ */
+void print_jobs() {
+
+    pthread_mutex_lock(&lock);
+    if(running == NULL)
+        printf("No jobs running\n");
+    else {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double secs = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) * 1e-9;
+        int64_t done = atomic_load(&visited);
+        int64_t size = atomic_load(&job_size);
+
+        printf("Running: %s\n", running);
+        printf("  elapsed: %0.1fs", secs);
+        if(size > 0)
+            printf(", done %" PRId64 " of %" PRId64 " (%0.0f%%)", done, size,
+                    (done < size)? 100.0 * done / size : 100.0);
+        printf("\n");
+        if(tail > head)
+            printf("  %d more queued\n", tail - head);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,49 @@
+/*
+ * Lines typed at the prompt are run as jobs on a worker thread, so the
+ * prompt stays live while a long statement runs. The evaluator checks for a
+ * cancel at each statement, each binary node and each block of an array, and
+ * counts the nodes it has done so that the progress of the job can be shown.
+ */
+#ifndef __JOB_H__
+#define __JOB_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define JOB_TICKS   0x400   // work counted locally before it is added up
+
+extern atomic_bool job_cancel;
+extern __thread int job_ticks;
+
+void start_worker(void (*run)(const char*));
+void submit_job(const char* line);
+bool wait_jobs(int msecs);
+void cancel_job();
+bool interrupt_job();
+void set_job_size(int64_t size);
+void add_ticks();
+void print_jobs();
+
+/*
+ * Count n units of work and return true if the job has been cancelled. A
+ * unit is a node visit, or an element for the array evaluator.
+ */
+static inline bool job_progress(int n) {
+
+    job_ticks += n;
+    if(job_ticks >= JOB_TICKS)
+        add_ticks();
+    return atomic_load_explicit(&job_cancel, memory_order_relaxed);
+}
+
+/*
+ * Count one node and return true if the job has been cancelled. This is
+ * called once per statement, so a leaf does not pay for the check.
+ */
+static inline bool job_cancelled() {
+
+    return job_progress(1);
+}
+
+#endif
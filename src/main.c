@@ -1,4 +1,3 @@
-
 /*
  * Simple calculator using flex and bison.
  *
@@ -8,37 +7,390 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ctype.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include "scan.h"
 #include "error.h"
+#include "program.h"
+#include "compile.h"
+#include "image.h"
+#include "import.h"
+#include "pool.h"
+#include "parallel.h"
+#include "stream.h"
+#include "memory.h"
+#include "symbols.h"
+#include "job.h"
+#include "session.h"
+
+// a line that takes longer than this runs in the background
+#define FOREGROUND_MSECS    250
+
+// set by quit, which runs on the worker thread when the prompt is live
+atomic_int quit_flag = 0;
+extern program_t* program;
+extern bool (*flush_program)(void);
+
+// the script that run_script() is reading
+static compiler_t* comp = NULL;
+static const char* image = NULL;
+static int script_errors = 0;
+
+/*
+ * Scan and parse one line of input. Return the number of errors, or
+ * CANCELLED if the line was cancelled.
+ */
+static int parse_line(const char* buf) {
+
+    void* s = yy_scan_string(buf);
+    int failed = yyparse();     // a syntax error is not counted by error()
+    yy_delete_buffer(s);
+
+    int status = atomic_load(&job_cancel)? CANCELLED : get_errors() + (failed != 0);
+    reset_errors();
+    return status;
+}
+
+/*
+ * Run a line typed at the prompt. This is where the session log is written.
+ */
+static void run_line(const char* buf) {
+
+    int64_t start = now_ns();
+    int status = parse_line(buf);
+    log_line(buf, start, status, now_ns() - start);
+}
+
+/*
+ * Run the statements of the script that have been saved so far. This is
+ * called before a command that reads or changes the symbols, so that the
+ * command sees what the lines before it did. The errors of the statements
+ * are counted for the script, not against the line of the command. A script
+ * that is saved as an image cannot be run part way, so return false for
+ * that.
+ */
+static bool flush_script() {
+
+    if(image != NULL)
+        return false;
+
+    int errors = get_errors();
+    if(comp != NULL) {
+        code_t* code = finish_compiler(comp);
+        run_code(code);
+        destroy_code(code);
+        comp = create_compiler();
+    }
+    else {
+        run_parallel(program);
+        clear_program(program);
+    }
+    script_errors += get_errors() - errors;
+    reset_errors();
+    add_errors(errors);
+
+    return true;
+}
+
+/*
+ * Read a script a line at a time. If the optimize flag is set, then the whole
+ * script is compiled into one program before any of it runs. Each statement
+ * is lowered as soon as it is parsed, so the ASTs are not kept around. If
+ * there is an image name, then the compiled program is saved to it instead of
+ * being run, unless there were errors. If there is more than one thread, then
+ * the whole script is parsed first so that statements that do not depend on
+ * each other can run at the same time. A command such as grad runs the
+ * statements before it first, see flush_script(). Return non-zero if the
+ * script had errors or if the image was not saved.
+ */
+static int run_script(const char* fname, int optimize) {
+
+    FILE* fp = fopen(fname, "r");
+    if(fp == NULL) {
+        fprintf(stderr, "cannot open script: %s\n", fname);
+        exit(1);
+    }
+
+    int status = 0;
+    if(optimize || image != NULL) {
+        program = create_program();
+        comp = create_compiler();
+    }
+    else if(pool_is_running())
+        program = create_program();
+    flush_program = flush_script;
+
+    char* buf = NULL;
+    size_t size = 0;
+    script_errors = 0;
+    while(!atomic_load(&quit_flag) && getline(&buf, &size, fp) > 0) {
+        script_errors += parse_line(buf) > 0;
+        if(comp != NULL) {
+            for(int i = 0; i < program->len; i++)
+                compile_statement(comp, program->list[i]);
+            clear_program(program);
+        }
+    }
+    free(buf);
+    fclose(fp);
+
+    if(comp != NULL) {
+        code_t* code = finish_compiler(comp);
+        if(image == NULL)
+            run_code(code);
+        else if(script_errors > 0 || get_errors() > 0) {
+            fprintf(stderr, "the script has errors, no image saved\n");
+            status = 1;
+        }
+        else if(!save_image(code, image))
+            status = 1;
+        script_errors += get_errors();
+        reset_errors();
+        destroy_code(code);
+        comp = NULL;
+    }
+    else if(program != NULL) {
+        run_parallel(program);
+        script_errors += get_errors();
+        reset_errors();
+    }
+
+    if(program != NULL) {
+        destroy_program(program);
+        program = NULL;
+    }
+    flush_program = NULL;
+
+    report_shapes();
+    return (script_errors > 0)? 1 : status;
+}
+
+/*
+ * Run a program that was saved by -c.
+ */
+static int run_image(const char* fname) {
+
+    code_t* code = load_image(fname);
+    if(code == NULL)
+        return 1;
+
+    run_code(code);
+    destroy_code(code);
+    return get_errors() > 0;
+}
+
+/*
+ * Parse the per-number expression for the stream mode. The number is in x.
+ */
+static ast_t* parse_expr(const char* str) {
+
+    add_symbol("x");
+    program = create_program();
+
+    char* buf = ALLOC(strlen(str) + 7);
+    sprintf(buf, "print %s", str);
+    parse_line(buf);
+    FREE(buf);
+
+    ast_t* expr = NULL;
+    if(program->len == 1) {
+        expr = program->list[0]->left;
+        program->list[0]->left = NULL;
+    }
+    else
+        fprintf(stderr, "invalid stream expression: %s\n", str);
+
+    destroy_program(program);
+    program = NULL;
+    return expr;
+}
+
+/*
+ * Return true if the line is only the word, with optional white space. The
+ * prompt handles these commands itself, because the worker may be busy.
+ */
+static bool is_command(const char* line, const char* word) {
+
+    size_t len = strlen(word);
+    while(isspace(*line))
+        line++;
+    if(strncmp(line, word, len) != 0)
+        return false;
+    for(line += len; isspace(*line); line++) {}
+    return *line == '\0';
+}
 
-int quit_flag = 0;
+// set when a ctrl-C at the prompt had no job to cancel
+static volatile sig_atomic_t clear_line = 0;
 
-int main() {
+/*
+ * Ctrl-C cancels the running job. At the prompt it clears the line instead
+ * of killing the calculator. Nothing here may print or call readline, so the
+ * line is cleared by on_signal_event().
+ */
+static void on_interrupt(int sig) {
+
+    (void)sig;
+    if(!interrupt_job())
+        clear_line = 1;
+}
+
+/*
+ * Readline calls this outside of the handler when a signal cuts its read
+ * short.
+ */
+static int on_signal_event() {
+
+    if(clear_line) {
+        clear_line = 0;
+        printf("\n");
+        rl_on_new_line();
+        rl_replace_line("", 0);
+        rl_redisplay();
+    }
+
+    return 0;
+}
+
+static void usage(const char* name) {
+
+    fprintf(stderr, "usage: %s [-O] [-j threads] [-s [-e expr] [-t secs]] [-r log | -p log | -P log] [-d places] [-i file] [-f script [-c image]] [-x image]\n"
+                    "  -f script  run the script and exit\n"
+                    "  -O         compile the whole script before running it\n"
+                    "  -c image   compile the script and save it to the image without running it\n"
+                    "  -x image   run a compiled image and exit\n"
+                    "  -j threads number of threads for large expressions and imports\n"
+                    "  -d places  start in decimal mode with this many places\n"
+                    "  -i file    import the name=value or name,value lines in the file\n"
+                    "             first, can be given more than once\n"
+                    "  -s         read numbers from stdin and set the stream_* symbols,\n"
+                    "             then run the script or print the symbols\n"
+                    "  -e expr    use the value of expr for each number, which is in x\n"
+                    "  -t secs    seconds between snapshots on stderr, 0 for none\n"
+                    "  -r log     record the lines typed at the prompt to the log\n"
+                    "  -p log     replay the log as fast as possible and show the latency\n"
+                    "             of each stage\n"
+                    "  -P log     replay the log at the pace it was recorded\n",
+                    name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
 
     char* buf;
+    const char* script = NULL;
+    int optimize = 0;
+    int threads = 1;
+    int stream = 0;
+    const char* stream_expr = NULL;
+    double interval = 1.0;
+    const char* record = NULL;
+    const char* replay = NULL;
+    const char* run = NULL;
+    const char** imports = ALLOC_LST(argc, const char*);
+    int nimports = 0;
+    bool paced = false;
+    int opt;
+
+    while((opt = getopt(argc, argv, "f:Oj:se:t:r:p:P:c:x:i:d:")) != -1) {
+        switch(opt) {
+            case 'f': script = optarg; break;
+            case 'O': optimize = 1; break;
+            case 'j': threads = atoi(optarg); break;
+            case 's': stream = 1; break;
+            case 'e': stream_expr = optarg; break;
+            case 't': interval = atof(optarg); break;
+            case 'r': record = optarg; break;
+            case 'p': replay = optarg; break;
+            case 'P': replay = optarg; paced = true; break;
+            case 'c': image = optarg; break;
+            case 'x': run = optarg; break;
+            case 'i': imports[nimports++] = optarg; break;
+            case 'd': decimal_scale = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if(decimal_scale < 0 || decimal_scale > MAX_SCALE) {
+        fprintf(stderr, "decimal places must be from 0 to %d\n", MAX_SCALE);
+        return 1;
+    }
+
+    start_pool(threads);
+
+    // a file with lines that could not be read is not run with the rest
+    for(int i = 0; i < nimports; i++)
+        if(import_file(imports[i]) < 0 || get_errors() > 0)
+            return 1;
+    reset_errors();
+    FREE(imports);
+
+    if(stream) {
+        ast_t* expr = NULL;
+        if(stream_expr != NULL && (expr = parse_expr(stream_expr)) == NULL)
+            return 1;
+
+        run_stream(stdin, expr, interval);
+        if(expr != NULL)
+            destroy_ast(expr);
+        if(script == NULL) {
+            print_stream();
+            return 0;
+        }
+    }
+
+    if(image != NULL && script == NULL)
+        usage(argv[0]);
+
+    if(script != NULL) {
+        return run_script(script, optimize);
+    }
+
+    if(run != NULL)
+        return run_image(run);
+
+    if(replay != NULL) {
+        replay_log(replay, paced, parse_line);
+        return 0;
+    }
+
+    if(record != NULL)
+        open_log(record);
 
     rl_bind_key('\t', rl_insert);
+    rl_signal_event_hook = on_signal_event;
+    signal(SIGINT, on_interrupt);
+    start_worker(run_line);
 
     printf("CALC v0.1\n'help' for commands.\n");
     while ((buf = readline("calc> ")) != NULL) {
         if (strlen(buf) > 0) {
             add_history(buf);
-
-            void* s = yy_scan_string(buf);
-            yyparse();
-            yy_delete_buffer(s);
-            reset_errors();
-
+            if(is_command(buf, "jobs"))
+                print_jobs();
+            else {
+                // quit does not wait for a long job to finish
+                if(is_command(buf, "quit") || is_command(buf, "q"))
+                    cancel_job();
+                submit_job(buf);
+                if(!wait_jobs(FOREGROUND_MSECS))
+                    printf("Running in the background, 'jobs' shows progress and ^C cancels\n");
+            }
         }
         // readline mallocs a new buffer every time.
         free(buf);
 
-        if(quit_flag)
+        if(atomic_load(&quit_flag))
             break;
     }
 
+    cancel_job();
+    wait_jobs(-1);
+    close_log();
     return 0;
 }
@@ -0,0 +1,410 @@
+/*
+ * Result cache.
+ *
+ * Every symbol has a version that goes up each time it is assigned. The key
+ * of an expression is its shape written out as bytes, with the variables
+ * written as their symbol handles, which never change. A saved result keeps
+ * the versions of the symbols the expression read. A lookup that finds the
+ * same key is only a hit if all of those symbols still have the same version,
+ * so an assignment makes every result that read the symbol stale without
+ * having to find them.
+ *
+ * Only expressions that could be slow are cached, which are the ones that
+ * call a function, read an array or are large. Writing out the key of a small
+ * expression costs about as much as evaluating it. An expression that calls
+ * a function that is not pure, such as load(), is never cached.
+ *
+ * The cache is limited to MEMO_BYTES, counting the arrays it holds. When it
+ * is full the entries that were used least recently are dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "memo.h"
+#include "symbols.h"
+#include "builtin.h"
+#include "array.h"
+#include "memory.h"
+
+#define MEMO_BYTES      (4 << 20)
+#define MEMO_MIN_NODES  32      // smaller expressions need a call or an array
+
+typedef struct {
+    symbol_table_t* sym;
+    uint64_t version;
+} dep_t;
+
+typedef struct _entry_t_ {
+    uint64_t hash;
+    value_t val;
+    size_t size;            // bytes counted against the limit
+    int key_len;
+    int ndeps;
+    unsigned char* key;     // these two are in the same block as the entry
+    dep_t* deps;
+    struct _entry_t_* next; // in the bucket
+    struct _entry_t_* newer;
+    struct _entry_t_* older;
+} entry_t;
+
+// the key of the last expression looked up on this thread
+typedef struct {
+    ast_t* expr;
+    bool ok;                // the expression is worth caching and can be
+    uint64_t hash;
+    unsigned char* buf;
+    int len;
+    int cap;
+    dep_t* deps;
+    int ndeps;
+    int dep_cap;
+    ast_t** spine;          // operators whose right side is still to be added
+    int spine_len;
+    int spine_cap;
+} memo_key_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static entry_t** buckets = NULL;
+static int nbuckets = 0;
+static int nentries = 0;
+static size_t nbytes = 0;
+static entry_t* newest = NULL;
+static entry_t* oldest = NULL;
+
+static long lookups = 0;
+static long hits = 0;
+static long stale = 0;
+static atomic_long skipped = 0;   // counted without the lock
+static long evictions = 0;
+
+static __thread memo_key_t key;
+
+static void add_bytes(memo_key_t* k, const void* data, int len) {
+
+    if(k->len + len > k->cap) {
+        k->cap = (k->cap == 0)? 0x100 : k->cap << 1;
+        while(k->len + len > k->cap)
+            k->cap <<= 1;
+        k->buf = (k->buf == NULL)? ALLOC(k->cap) : REALLOC(k->buf, k->cap);
+    }
+
+    memcpy(k->buf + k->len, data, len);
+    k->len += len;
+}
+
+static void add_dep(memo_key_t* k, symbol_table_t* sym) {
+
+    for(int i = 0; i < k->ndeps; i++)
+        if(k->deps[i].sym == sym)
+            return;
+
+    if(k->ndeps + 1 > k->dep_cap) {
+        k->dep_cap = (k->dep_cap == 0)? 0x10 : k->dep_cap << 1;
+        k->deps = (k->deps == NULL)? ALLOC_LST(k->dep_cap, dep_t) :
+                                    REALLOC_LST(k->deps, k->dep_cap, dep_t);
+    }
+
+    k->deps[k->ndeps].sym = sym;
+    k->deps[k->ndeps].version = sym->version;
+    k->ndeps++;
+}
+
+static bool add_node(memo_key_t* k, ast_t* node);
+
+/*
+ * Write out a node that is not an operator. Return false if it cannot be
+ * cached.
+ */
+static bool add_operand(memo_key_t* k, ast_t* node) {
+
+    unsigned char tag[2] = { node->type, 0 };
+
+    switch(node->type) {
+        case LITERAL_NODE:
+            tag[1] = node->value.val->val.type;
+            add_bytes(k, tag, 2);
+            add_bytes(k, &node->value.val->val.ival, sizeof(int64_t));
+            if(tag[1] == DEC_VAL)
+                add_bytes(k, &node->value.val->val.scale, sizeof(int));
+            return true;
+
+        case VARIABLE_NODE: {
+                symbol_table_t* sym = node->value.var->sym;
+                if(sym == NULL)
+                    sym = find_handle(node->value.var->name);
+                if(sym == NULL)
+                    return false;
+                add_bytes(k, tag, 2);
+                add_bytes(k, &sym, sizeof(sym));
+                add_dep(k, sym);
+            }
+            return true;
+
+        case CALL_NODE: {
+                call_node_t* call = node->value.call;
+                if(!builtins[call->func].pure || call->str != NULL)
+                    return false;
+                tag[1] = (node->right != NULL);
+                add_bytes(k, tag, 2);
+                add_bytes(k, &call->func, sizeof(int));
+                return add_node(k, node->left) &&
+                        (node->right == NULL || add_node(k, node->right));
+            }
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Write out the node and its children. Return false if the expression
+ * cannot be cached. The operators down the left side of a chain such as
+ * a+b+c+... are written in a loop and their right sides afterwards, which
+ * gives the same key as writing each operator and then its two sides, but
+ * does not use up the stack on a long chain.
+ */
+static bool add_node(memo_key_t* k, ast_t* node) {
+
+    unsigned char tag[2];
+    int base = k->spine_len;
+
+    for(; node->type == UNARY_NODE || node->type == BINARY_NODE; node = node->left) {
+        tag[0] = node->type;
+        tag[1] = node->value.op->op;
+        add_bytes(k, tag, 2);
+        if(k->spine_len + 1 > k->spine_cap) {
+            k->spine_cap = (k->spine_cap == 0)? 0x40 : k->spine_cap << 1;
+            k->spine = (k->spine == NULL)? ALLOC_LST(k->spine_cap, ast_t*) :
+                                    REALLOC_LST(k->spine, k->spine_cap, ast_t*);
+        }
+        k->spine[k->spine_len++] = node;
+    }
+
+    bool ok = add_operand(k, node);
+    while(ok && k->spine_len > base) {
+        node = k->spine[--k->spine_len];
+        ok = node->right == NULL || add_node(k, node->right);
+    }
+
+    k->spine_len = base;
+    return ok;
+}
+
+/*
+ * Return true if a small expression calls a function or reads an array. The
+ * left side is followed in a loop, the same as add_node().
+ */
+static bool is_slow(ast_t* node) {
+
+    for(; node != NULL; node = node->left) {
+        if(node->type == CALL_NODE)
+            return true;
+        if(node->type == VARIABLE_NODE) {
+            symbol_table_t* sym = node->value.var->sym;
+            return sym != NULL && sym->value.type == ARRAY_VAL;
+        }
+        if(is_slow(node->right))
+            return true;
+    }
+
+    return false;
+}
+
+static uint64_t hash_key(memo_key_t* k) {
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(int i = 0; i < k->len; i++)
+        h = (h ^ k->buf[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+static void make_key(ast_t* expr) {
+
+    key.expr = expr;
+    key.len = 0;
+    key.ndeps = 0;
+    // a decimal product or quotient is rounded to the places that are set
+    add_bytes(&key, &decimal_scale, sizeof(int));
+    key.ok = (expr->size >= MEMO_MIN_NODES || is_slow(expr)) && add_node(&key, expr);
+    key.hash = key.ok? hash_key(&key) : 0;
+}
+
+static void unlink_lru(entry_t* e) {
+
+    if(e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        newest = e->older;
+    if(e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        oldest = e->newer;
+}
+
+static void link_lru(entry_t* e) {
+
+    e->newer = NULL;
+    e->older = newest;
+    if(newest != NULL)
+        newest->newer = e;
+    newest = e;
+    if(oldest == NULL)
+        oldest = e;
+}
+
+static void remove_entry(entry_t* e) {
+
+    entry_t** p = &buckets[e->hash & (nbuckets - 1)];
+    while(*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+
+    unlink_lru(e);
+    nentries--;
+    nbytes -= e->size;
+    release_value(e->val);
+    FREE(e);
+}
+
+static void grow_table() {
+
+    int size = (nbuckets == 0)? 0x100 : nbuckets << 1;
+    entry_t** list = ALLOC_LST(size, entry_t*);
+
+    for(int i = 0; i < nbuckets; i++) {
+        entry_t* e = buckets[i];
+        while(e != NULL) {
+            entry_t* next = e->next;
+            e->next = list[e->hash & (size - 1)];
+            list[e->hash & (size - 1)] = e;
+            e = next;
+        }
+    }
+
+    if(buckets != NULL)
+        FREE(buckets);
+    buckets = list;
+    nbuckets = size;
+}
+
+static entry_t* find_entry(memo_key_t* k) {
+
+    if(nbuckets == 0)
+        return NULL;
+
+    for(entry_t* e = buckets[k->hash & (nbuckets - 1)]; e != NULL; e = e->next)
+        if(e->hash == k->hash && e->key_len == k->len && memcmp(e->key, k->buf, k->len) == 0)
+            return e;
+
+    return NULL;
+}
+
+/*
+ * Look for a saved result of the expression. Return true and set val if
+ * there is one and nothing the expression reads has changed. The caller owns
+ * the value and releases it as usual.
+ */
+bool find_memo(ast_t* expr, value_t* val) {
+
+    make_key(expr);
+    if(!key.ok) {
+        atomic_fetch_add_explicit(&skipped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    lookups++;
+    entry_t* e = find_entry(&key);
+    if(e != NULL) {
+        for(int i = 0; i < e->ndeps; i++)
+            if(e->deps[i].sym->version != e->deps[i].version) {
+                remove_entry(e);
+                stale++;
+                e = NULL;
+                break;
+            }
+    }
+
+    if(e != NULL) {
+        hits++;
+        unlink_lru(e);
+        link_lru(e);
+        *val = e->val;
+        if(val->type == ARRAY_VAL)
+            ref_array(val->aval);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return e != NULL;
+}
+
+/*
+ * Save the result of an expression that find_memo() did not find. The cache
+ * takes its own reference to an array.
+ */
+void save_memo(ast_t* expr, value_t val) {
+
+    if(key.expr != expr)
+        make_key(expr);
+    if(!key.ok)
+        return;
+
+    size_t size = sizeof(entry_t) + key.len + key.ndeps * sizeof(dep_t);
+    if(val.type == ARRAY_VAL)
+        size += val.aval->len * sizeof(double);
+    if(size > MEMO_BYTES / 4)
+        return;
+
+    pthread_mutex_lock(&lock);
+    entry_t* e = find_entry(&key);
+    if(e != NULL)
+        remove_entry(e);
+
+    while(oldest != NULL && nbytes + size > MEMO_BYTES) {
+        remove_entry(oldest);
+        evictions++;
+    }
+
+    if(nentries + 1 > nbuckets)
+        grow_table();
+
+    e = ALLOC(sizeof(entry_t) + key.ndeps * sizeof(dep_t) + key.len);
+    e->deps = (dep_t*)(e + 1);
+    e->key = (unsigned char*)(e->deps + key.ndeps);
+    if(key.ndeps > 0)
+        memcpy(e->deps, key.deps, key.ndeps * sizeof(dep_t));
+    memcpy(e->key, key.buf, key.len);
+    e->ndeps = key.ndeps;
+    e->key_len = key.len;
+    e->hash = key.hash;
+    e->size = size;
+    e->val = val;
+    if(val.type == ARRAY_VAL)
+        ref_array(val.aval);
+
+    e->next = buckets[e->hash & (nbuckets - 1)];
+    buckets[e->hash & (nbuckets - 1)] = e;
+    link_lru(e);
+    nentries++;
+    nbytes += size;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Show how well the cache is doing.
+ */
+void print_memo_stats() {
+
+    pthread_mutex_lock(&lock);
+    printf("Result cache: %d entr%s, %zu of %d bytes\n", nentries,
+            (nentries == 1)? "y" : "ies", nbytes, MEMO_BYTES);
+    printf("  lookups: %ld, hits: %ld (%0.1f%%), stale: %ld, evicted: %ld\n",
+            lookups, hits, (lookups > 0)? 100.0 * hits / lookups : 0.0,
+            stale, evictions);
+    printf("  not cached: %ld\n", atomic_load(&skipped));
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,18 @@
+/*
+ * Cache of the results of print statements. When the same expression is
+ * printed again and none of the variables it reads have been assigned since,
+ * the saved value is printed instead of evaluating it again.
+ */
+#ifndef __MEMO_H__
+#define __MEMO_H__
+
+#include <stdbool.h>
+
+#include "ast.h"
+#include "value.h"
+
+bool find_memo(ast_t* expr, value_t* val);
+void save_memo(ast_t* expr, value_t val);
+void print_memo_stats();
+
+#endif
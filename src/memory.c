@@ -47,4 +47,19 @@ char* memory_strdup(const char* str) {
     }
     memcpy(buf, str, len);
     return buf;
-}
\ No newline at end of file
+}
+
+/*
+ * Allocate a block that starts on a multiple of align bytes. The memory is
+ * not cleared. It is freed with memory_free().
+ */
+void* memory_alloc_aligned(size_t align, size_t size) {
+
+    void* ptr = NULL;
+    if(posix_memalign(&ptr, align, (size > 0)? size : align) != 0) {
+        fprintf(stderr, "cannot allocate %lu aligned bytes\n", size);
+        exit(1);
+    }
+
+    return ptr;
+}
@@ -10,10 +10,12 @@
 #define REALLOC_LST(p,n,t) memory_realloc((p), ((n)*sizeof(t)))
 #define STRDUP(s)       memory_strdup(s)
 #define FREE(p)         memory_free(p)
+#define ALLOC_ALIGNED(a,s) memory_alloc_aligned((a), (s))
 
 void* memory_alloc(size_t size);
 void* memory_realloc(void* ptr, size_t size);
 char* memory_strdup(const char* str);
 void memory_free(void* ptr);
+void* memory_alloc_aligned(size_t align, size_t size);
 
 #endif
\ No newline at end of file
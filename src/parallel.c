@@ -0,0 +1,275 @@
+/*
+ * Statement scheduler.
+ *
+ * Every statement is given a level. A statement that reads a variable goes
+ * on a level after the statement that last wrote it. A statement that writes
+ * a variable goes on a level after every earlier statement that read or
+ * wrote it. Statements on the same level cannot see each other's effects, so
+ * each level is split into chunks that run on the pool. The levels run one
+ * after another, which keeps the result the same as running the statements
+ * in order.
+ *
+ * Print statements keep their value and the values are printed in program
+ * order as soon as every statement before them has finished.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "ast.h"
+#include "parallel.h"
+#include "pool.h"
+#include "memory.h"
+#include "error.h"
+
+// levels smaller than this are run on the calling thread
+#define MIN_CHUNK   0x20
+
+typedef struct {
+    const char* name;   // NULL if the slot is empty
+    int write_level;    // -1 if not written yet
+    int read_level;     // -1 if not read yet
+} var_t;
+
+typedef struct {
+    var_t* vars;
+    int len;
+    int cap;
+} var_table_t;
+
+typedef struct {
+    program_t* prog;
+    int* order;
+    int start;
+    int end;
+    value_t* results;
+} chunk_t;
+
+static unsigned int hash_name(const char* name) {
+
+    unsigned int h = 2166136261u;
+    while(*name != '\0')
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+static var_t* find_slot(var_t* vars, int cap, const char* name) {
+
+    unsigned int idx = hash_name(name) & (cap - 1);
+    while(vars[idx].name != NULL && strcmp(vars[idx].name, name) != 0)
+        idx = (idx + 1) & (cap - 1);
+
+    return &vars[idx];
+}
+
+/*
+ * Find the variable, adding it if it is not in the table yet.
+ */
+static var_t* find_var(var_table_t* tab, const char* name) {
+
+    if((tab->len + 1) * 2 > tab->cap) {
+        var_t* old = tab->vars;
+        int old_cap = tab->cap;
+        tab->cap <<= 1;
+        tab->vars = ALLOC_LST(tab->cap, var_t);
+        for(int i = 0; i < old_cap; i++)
+            if(old[i].name != NULL)
+                *find_slot(tab->vars, tab->cap, old[i].name) = old[i];
+        FREE(old);
+    }
+
+    var_t* var = find_slot(tab->vars, tab->cap, name);
+    if(var->name == NULL) {
+        var->name = name;
+        var->write_level = -1;
+        var->read_level = -1;
+        tab->len++;
+    }
+
+    return var;
+}
+
+/*
+ * Raise the level to be after the last write of every variable read. These
+ * walks follow the left side in a loop, so that a long chain such as
+ * a+b+c+... does not use up the stack.
+ */
+static void after_writes(var_table_t* tab, ast_t* node, int* level) {
+
+    for(; node != NULL; node = node->left) {
+        if(node->type == VARIABLE_NODE) {
+            var_t* var = find_var(tab, node->value.var->name);
+            if(var->write_level + 1 > *level)
+                *level = var->write_level + 1;
+        }
+
+        if(node->right != NULL)
+            after_writes(tab, node->right, level);
+    }
+}
+
+static void mark_reads(var_table_t* tab, ast_t* node, int level) {
+
+    for(; node != NULL; node = node->left) {
+        if(node->type == VARIABLE_NODE) {
+            var_t* var = find_var(tab, node->value.var->name);
+            if(level > var->read_level)
+                var->read_level = level;
+        }
+
+        if(node->right != NULL)
+            mark_reads(tab, node->right, level);
+    }
+}
+
+/*
+ * Work out the level of every statement and return the number of levels.
+ */
+static int find_levels(program_t* prog, int* levels) {
+
+    var_table_t tab;
+    tab.len = 0;
+    tab.cap = 0x100;
+    tab.vars = ALLOC_LST(tab.cap, var_t);
+
+    int num_levels = 0;
+    for(int i = 0; i < prog->len; i++) {
+        ast_t* stmt = prog->list[i];
+        bool is_print = (stmt->value.op->op == PRINT_OP);
+        ast_t* expr = is_print? stmt->left : stmt->right;
+        int level = 0;
+
+        after_writes(&tab, expr, &level);
+        if(!is_print) {
+            var_t* var = find_var(&tab, stmt->left->value.var->name);
+            if(var->write_level + 1 > level)
+                level = var->write_level + 1;
+            if(var->read_level + 1 > level)
+                level = var->read_level + 1;
+        }
+
+        mark_reads(&tab, expr, level);
+        if(!is_print)
+            find_var(&tab, stmt->left->value.var->name)->write_level = level;
+
+        levels[i] = level;
+        if(level + 1 > num_levels)
+            num_levels = level + 1;
+    }
+
+    FREE(tab.vars);
+    return num_levels;
+}
+
+/*
+ * Each statement starts with no errors, the same as in run_program(). The
+ * count that is left is the total of the chunk, which join_task() gives to
+ * the thread that joins it.
+ */
+static void run_chunk(task_t* task) {
+
+    chunk_t* chunk = task->data;
+    int errors = 0;
+    for(int i = chunk->start; i < chunk->end; i++) {
+        int n = chunk->order[i];
+        reset_errors();
+        chunk->results[n] = traverse_ast(chunk->prog->list[n]);
+        errors += get_errors();
+    }
+
+    reset_errors();
+    add_errors(errors);
+}
+
+/*
+ * Run one level, which is the statements order[start] to order[end - 1].
+ */
+static void run_level(program_t* prog, int* order, int start, int end, value_t* results) {
+
+    int count = end - start;
+    int num_chunks = pool_threads() * 4;
+    if(num_chunks > count / MIN_CHUNK)
+        num_chunks = count / MIN_CHUNK;
+    if(num_chunks < 1)
+        num_chunks = 1;
+
+    chunk_t* chunks = ALLOC_LST(num_chunks, chunk_t);
+    task_t* tasks = ALLOC_LST(num_chunks, task_t);
+    for(int i = 0; i < num_chunks; i++) {
+        chunks[i].prog = prog;
+        chunks[i].order = order;
+        chunks[i].start = start + (int)((long)count * i / num_chunks);
+        chunks[i].end = start + (int)((long)count * (i + 1) / num_chunks);
+        chunks[i].results = results;
+        tasks[i].func = run_chunk;
+        tasks[i].data = &chunks[i];
+    }
+
+    for(int i = 1; i < num_chunks; i++)
+        fork_task(&tasks[i]);
+    run_chunk(&tasks[0]);
+    for(int i = num_chunks - 1; i > 0; i--)
+        join_task(&tasks[i]);
+
+    FREE(tasks);
+    FREE(chunks);
+}
+
+/*
+ * Run the program with independent statements in parallel. If the pool is
+ * not running, then this is the same as running the statements in order.
+ * The errors of the statements are added to the count of the caller.
+ */
+void run_parallel(program_t* prog) {
+
+    if(!pool_is_running() || prog->len == 0) {
+        run_program(prog);
+        return;
+    }
+
+    msg(1, "Run the program in parallel");
+    int* levels = ALLOC_LST(prog->len, int);
+    int num_levels = find_levels(prog, levels);
+    msg(1, "%d statements in %d levels", prog->len, num_levels);
+
+    // sort the statements by level, keeping program order within a level
+    int* first = ALLOC_LST(num_levels + 1, int);
+    for(int i = 0; i < prog->len; i++)
+        first[levels[i] + 1]++;
+    for(int i = 0; i < num_levels; i++)
+        first[i + 1] += first[i];
+
+    int* order = ALLOC_LST(prog->len, int);
+    int* fill = ALLOC_LST(num_levels, int);
+    memcpy(fill, first, num_levels * sizeof(int));
+    for(int i = 0; i < prog->len; i++)
+        order[fill[levels[i]]++] = i;
+
+    value_t* results = ALLOC_LST(prog->len, value_t);
+    bool* done = ALLOC_LST(prog->len, bool);
+    int next = 0;
+    int errors = get_errors();
+
+    // the first chunk of a level runs here, so the count afterwards is the
+    // errors of the level
+    for(int level = 0; level < num_levels; level++) {
+        run_level(prog, order, first[level], first[level + 1], results);
+        errors += get_errors();
+        for(int i = first[level]; i < first[level + 1]; i++)
+            done[order[i]] = true;
+
+        for(; next < prog->len && done[next]; next++)
+            if(prog->list[next]->value.op->op == PRINT_OP) {
+                print_value("Result: ", results[next]);
+                release_value(results[next]);
+            }
+    }
+
+    reset_errors();
+    add_errors(errors);
+    FREE(done);
+    FREE(results);
+    FREE(fill);
+    FREE(order);
+    FREE(first);
+    FREE(levels);
+}
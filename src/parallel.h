@@ -0,0 +1,12 @@
+/*
+ * Run the statements of a program on the thread pool, with statements that
+ * do not depend on each other running at the same time.
+ */
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include "program.h"
+
+void run_parallel(program_t* prog);
+
+#endif
@@ -54,8 +54,16 @@ extern int yydebug;
     HELP = 260,
     QUIT = 261,
     VERBO = 262,
-    IDENT = 263,
-    NUMBER = 264
+    GRAD = 263,
+    WRT = 264,
+    STATS = 265,
+    IMPORT = 266,
+    DECIMAL = 267,
+    IDENT = 268,
+    NUMBER = 269,
+    INTEGER = 270,
+    STRING = 271,
+    DECNUM = 272
   };
 #endif
 
@@ -68,9 +76,12 @@ union YYSTYPE
 
     const char* ident;
     double number;
+    int64_t integer;
+    value_t value;
     ast_t* node;
+    grad_t* grad;
 
-#line 74 "parse.h" /* yacc.c:1921  */
+#line 76 "parse.h" /* yacc.c:1921  */
 };
 
 typedef union YYSTYPE YYSTYPE;
@@ -4,16 +4,131 @@
  */
 %{
 
+#include <stdio.h>
+#include <limits.h>
+
 #include "ast.h"
 #include "scan.h"
 #include "symbols.h"
 #include "error.h"
+#include "program.h"
+#include "builtin.h"
+#include "memory.h"
+#include "grad.h"
+#include "job.h"
+#include "session.h"
+#include "memo.h"
+#include "import.h"
 
-extern int quit_flag;
+extern atomic_int quit_flag;
 extern ast_t* root;
 
 int verbose = 0;
 
+// when this is set, statements are saved here instead of being run
+program_t* program = NULL;
+
+// runs the statements that have been saved so far, see before_command()
+bool (*flush_program)(void) = NULL;
+
+// the parser calls the scanner through timed_lex() so that a replay can
+// time the scanner by itself
+static int timed_lex(void);
+#define yylex timed_lex
+
+/*
+ * Resolve a function call to its index in the builtin table.
+ */
+static ast_t* call(const char* name, ast_t* arg1, ast_t* arg2) {
+
+    int nargs = (arg2 == NULL)? 1 : 2;
+    int func = find_builtin(name, nargs);
+    if(func < 0) {
+        error("unknown function %s() with %d argument%s", name, nargs, (nargs == 1)? "" : "s");
+        FREE((void*)name);
+        destroy_ast(arg1);
+        if(arg2 != NULL)
+            destroy_ast(arg2);
+        return ast_literal(NAN_VALUE);
+    }
+    else if(builtins[func].kind == LOAD_FUNC) {
+        error("function %s() takes a file name in quotes", name);
+        FREE((void*)name);
+        destroy_ast(arg1);
+        return ast_literal(NAN_VALUE);
+    }
+
+    FREE((void*)name);
+    return ast_call(func, arg1, arg2);
+}
+
+/*
+ * Resolve a call with a file name argument, which only load() takes.
+ */
+static ast_t* call_file(const char* name, const char* fname) {
+
+    int func = find_builtin(name, 1);
+    if(func < 0 || builtins[func].kind != LOAD_FUNC) {
+        error("function %s() does not take a file name", name);
+        FREE((void*)name);
+        FREE((void*)fname);
+        return ast_literal(NAN_VALUE);
+    }
+
+    FREE((void*)name);
+    return ast_load(func, fname);
+}
+
+/*
+ * A command that reads or changes the symbols runs as soon as it is parsed.
+ * If statements are being saved, then the ones before it are run first, so
+ * that it sees the same symbols as it would if each line ran as it was read.
+ * Return false, after reporting it, if they cannot be run yet.
+ */
+static bool before_command(const char* name) {
+
+    if(program == NULL)
+        return true;
+
+    if(flush_program == NULL || !flush_program()) {
+        error("%s cannot be used in a script that is saved as an image", name);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * A replay times the commands apart from the parser, because a command such
+ * as grad or import can take much longer than parsing the line.
+ */
+static int64_t command_start;
+
+static void start_command() {
+
+    if(stage_timing)
+        command_start = now_ns();
+}
+
+static void end_command() {
+
+    if(stage_timing)
+        stage_ns[COMMAND_STAGE] += now_ns() - command_start;
+}
+
+static void statement(ast_t* stmt) {
+
+    if(program == NULL) {
+        set_job_size(stmt->size);
+        execute_statement(stmt);
+        destroy_ast(stmt);
+    }
+    else if(get_errors() == 0)
+        add_statement(program, stmt);
+    else
+        destroy_ast(stmt);
+}
+
 %}
 %define parse.error verbose
 %debug
@@ -23,14 +138,21 @@ int verbose = 0;
 %union {
     const char* ident;
     double number;
+    int64_t integer;
+    value_t value;
     ast_t* node;
+    grad_t* grad;
 };
 
-%token PRINT SYMT HELP QUIT VERBO
+%token PRINT SYMT HELP QUIT VERBO GRAD WRT STATS IMPORT DECIMAL
 %token <ident> IDENT
 %token <number> NUMBER
+%token <integer> INTEGER
+%token <ident> STRING
+%token <value> DECNUM
 
 %type <node> line assignment print term factor unary primary
+%type <grad> gradient
 
 %%
     /* top level rule */
@@ -38,33 +160,102 @@ line
     : /* empty */ { $$ = NULL; }
     | assignment {
         //$$ = $1;
-        traverse_ast($$);
-        destroy_ast($$);
+        statement($$);
     }
     | print {
         //$$ = $1;
-        printf("Result: %0.3f\n", traverse_ast($$));
-        destroy_ast($$);
+        statement($$);
+    }
+    | gradient {
+        start_command();
+        if(before_command("grad"))
+            run_grad($1);
+        destroy_grad($1);
+        end_command();
     }
     | SYMT  {
         //msg(2, "show symbols:");
-        dump_symbols();
-    }
-    | HELP { printf("\nCommands:\n"
-                    "quit|q    = end the calculator\n"
-                    "help|?|h  = show this text\n"
-                    "print|p   = print the value of a variable or expression\n"
-                    "symt|s    = show the symbol table\n"
-                    "verbose|v = show what's happening in the program\n\n"); }
+        start_command();
+        dump_symbols(NULL, SYMT_LIMIT);
+        end_command();
+    }
+    | SYMT INTEGER {
+        start_command();
+        dump_symbols(NULL, ($2 > INT_MAX)? INT_MAX : (int)$2);
+        end_command();
+    }
+    | SYMT STRING {
+        start_command();
+        dump_symbols($2, SYMT_LIMIT);
+        end_command();
+        FREE((void*)$2);
+    }
+    | SYMT STRING INTEGER {
+        start_command();
+        dump_symbols($2, ($3 > INT_MAX)? INT_MAX : (int)$3);
+        end_command();
+        FREE((void*)$2);
+    }
+    | STATS {
+        start_command();
+        print_memo_stats();
+        end_command();
+    }
+    | IMPORT STRING {
+        start_command();
+        if(before_command("import"))
+            import_file($2);
+        end_command();
+        FREE((void*)$2);
+    }
+    | DECIMAL {
+        if(decimal_scale > 0)
+            printf("Decimal mode with %d places\n", decimal_scale);
+        else
+            printf("Decimal mode is off\n");
+    }
+    | DECIMAL INTEGER {
+        if($2 > MAX_SCALE)
+            error("decimal takes from 0 to %d places", MAX_SCALE);
+        else if(before_command("decimal")) {
+            decimal_scale = (int)$2;
+            msg(3, "decimal places set to %d", decimal_scale);
+        }
+    }
+    | HELP {
+        start_command();
+        printf("\nCommands:\n"
+               "quit|q    = end the calculator\n"
+               "help|?|h  = show this text\n"
+               "print|p   = print the value of a variable or expression\n"
+               "symt|s    = show the symbol table, symt \"x*\" 20 shows the first\n"
+               "            20 names that match, a limit of 0 shows all of them\n"
+               "stats     = show how often printed results came from the cache\n"
+               "import    = import \"file\" sets the variables in a file of\n"
+               "            name=value or name,value lines\n"
+               "decimal   = decimal 2 reads numbers with a point as exact\n"
+               "            decimals with 2 places, decimal 0 turns it off\n"
+               "verbose|v = show what's happening in the program\n"
+               "jobs      = show the progress of a line running in the background\n"
+               "^C        = cancel the line that is running\n"
+               "grad      = grad expr wrt a, b, ... shows the value and the\n"
+               "            partial derivatives with respect to a, b, ...\n"
+               "\nArrays are made by range() and load(). The operators and\n"
+               "the math functions work on them element by element.\n"
+               "\nFunctions:\n");
+        list_builtins();
+        printf("\n");
+        end_command();
+    }
     | QUIT {
         //msg(3, "quit");
-        quit_flag = 1;
+        atomic_store(&quit_flag, 1);
     }
     | VERBO {
         verbose++;
         msg(3, "verbose set to %d", verbose);
     }
-    | VERBO NUMBER {
+    | VERBO INTEGER {
         verbose = (int)$2;
         msg(3, "verbose set to %d", verbose);
     }
@@ -87,6 +278,20 @@ print
     }
     ;
 
+    /* derivatives of an expression */
+gradient
+    : GRAD term WRT IDENT {
+        msg(3, "gradient rule");
+        $$ = create_grad($2);
+        add_grad_name($$, $4);
+    }
+    | gradient ',' IDENT {
+        msg(3, "gradient list rule");
+        add_grad_name($1, $3);
+        $$ = $1;
+    }
+    ;
+
     /* lowest precidence element */
 term
     : factor
@@ -134,17 +339,40 @@ unary
 primary
     : IDENT {
         msg(3, "identifier: \"%s\"", $1);
-        if(SYM_NOT_FOUND == find_symbol($1, NULL))
+        if(SYM_NOT_FOUND == find_symbol($1, NULL)) {
             error("symbol \"%s\" is not found", $1);
+            $$ = ast_literal(NAN_VALUE);
+        }
         else
             $$ = ast_variable($1);
     }
     | NUMBER {
         msg(3, "literal number: %0.3f rule", $1);
+        $$ = ast_literal(FLOAT_VALUE($1));
+    }
+    | INTEGER {
+        msg(3, "literal integer: %ld rule", (long)$1);
+        $$ = ast_literal(INT_VALUE($1));
+    }
+    | DECNUM {
+        msg(3, "literal decimal: %ld scale %d rule", (long)$1.ival, $1.scale);
         $$ = ast_literal($1);
     }
     | '(' term ')' {
         msg(3, "(term) rule");
+        $$ = $2;
+    }
+    | IDENT '(' term ')' {
+        msg(3, "call %s(term) rule", $1);
+        $$ = call($1, $3, NULL);
+    }
+    | IDENT '(' term ',' term ')' {
+        msg(3, "call %s(term, term) rule", $1);
+        $$ = call($1, $3, $5);
+    }
+    | IDENT '(' STRING ')' {
+        msg(3, "call %s(string) rule", $1);
+        $$ = call_file($1, $3);
     }
     ;
 
@@ -155,6 +383,18 @@ primary
 
 extern char yytext[];
 
+#undef yylex
+static int timed_lex(void) {
+
+    if(!stage_timing)
+        return yylex();
+
+    int64_t start = now_ns();
+    int token = yylex();
+    stage_ns[SCAN_STAGE] += now_ns() - start;
+    return token;
+}
+
 void yyerror(const char* s)
 {
     fflush(stderr);
@@ -0,0 +1,184 @@
+/*
+ * Work-stealing thread pool. Each thread owns a deque of tasks. The owner
+ * pushes and pops at the bottom and other threads steal from the top, so the
+ * oldest, and usually largest, task is the one that moves to another thread.
+ * The thread that starts the pool is thread 0. It does not get a pthread of
+ * its own; it works its deque when it joins a task.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "pool.h"
+#include "memory.h"
+#include "error.h"
+
+#define DEQUE_SIZE  0x100
+
+typedef struct {
+    pthread_mutex_t lock;
+    task_t* tasks[DEQUE_SIZE];
+    int top;    // next task to steal
+    int bottom; // next free slot
+} deque_t;
+
+static deque_t* deques = NULL;
+static int num_threads = 0;
+static atomic_int pending = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static __thread int self = 0;
+
+/*
+ * Push a task on the bottom of our own deque. Return false if it is full.
+ */
+static bool push_task(task_t* task) {
+
+    deque_t* dq = &deques[self];
+    bool pushed = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->bottom - dq->top < DEQUE_SIZE) {
+        dq->tasks[dq->bottom++ % DEQUE_SIZE] = task;
+        atomic_fetch_add(&pending, 1);
+        pushed = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return pushed;
+}
+
+/*
+ * Take the newest task from our own deque, or the oldest task from another
+ * thread's deque.
+ */
+static task_t* take_task() {
+
+    task_t* task = NULL;
+    deque_t* dq = &deques[self];
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->bottom > dq->top)
+        task = dq->tasks[--dq->bottom % DEQUE_SIZE];
+    pthread_mutex_unlock(&dq->lock);
+
+    for(int i = 1; task == NULL && i < num_threads; i++) {
+        dq = &deques[(self + i) % num_threads];
+        pthread_mutex_lock(&dq->lock);
+        if(dq->bottom > dq->top)
+            task = dq->tasks[dq->top++ % DEQUE_SIZE];
+        pthread_mutex_unlock(&dq->lock);
+    }
+
+    if(task != NULL)
+        atomic_fetch_sub(&pending, 1);
+
+    return task;
+}
+
+/*
+ * Run the task with its own error count. The errors are kept in the task
+ * and added to the count of the thread that joins it, which is the thread
+ * the errors belong to.
+ */
+static void run_task(task_t* task) {
+
+    int errors = get_errors();
+    reset_errors();
+    task->func(task);
+    task->errors = get_errors();
+    reset_errors();
+    add_errors(errors);
+    atomic_store_explicit(&task->done, 1, memory_order_release);
+}
+
+static void* worker(void* arg) {
+
+    self = (int)(long)arg;
+    msg(2, "pool thread %d started", self);
+
+    while(1) {
+        task_t* task = take_task();
+        if(task != NULL)
+            run_task(task);
+        else {
+            pthread_mutex_lock(&idle_lock);
+            while(atomic_load(&pending) == 0)
+                pthread_cond_wait(&idle_cond, &idle_lock);
+            pthread_mutex_unlock(&idle_lock);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the pool with the given number of threads, counting the caller. The
+ * pool is never started with fewer than two threads.
+ */
+void start_pool(int threads) {
+
+    if(deques != NULL || threads < 2)
+        return;
+
+    msg(1, "Start the thread pool with %d threads", threads);
+    deques = ALLOC_LST(threads, deque_t);
+    for(int i = 0; i < threads; i++)
+        pthread_mutex_init(&deques[i].lock, NULL);
+    num_threads = threads;
+
+    for(int i = 1; i < threads; i++) {
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, worker, (void*)(long)i) != 0) {
+            fprintf(stderr, "cannot create pool thread\n");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+}
+
+bool pool_is_running() {
+
+    return deques != NULL;
+}
+
+int pool_threads() {
+
+    return num_threads;
+}
+
+/*
+ * Make the task available to other threads. If there is no room for it, then
+ * it is run right away.
+ */
+void fork_task(task_t* task) {
+
+    atomic_store(&task->done, 0);
+    if(!push_task(task)) {
+        run_task(task);
+        return;
+    }
+
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/*
+ * Wait for the task to finish, running other tasks until it does. If nobody
+ * has stolen it, then it is on the bottom of our own deque and it is the
+ * first one taken.
+ */
+void join_task(task_t* task) {
+
+    while(!atomic_load_explicit(&task->done, memory_order_acquire)) {
+        task_t* other = take_task();
+        if(other != NULL)
+            run_task(other);
+        else
+            sched_yield();
+    }
+
+    add_errors(task->errors);
+}
@@ -0,0 +1,30 @@
+/*
+ * A small work-stealing thread pool used to evaluate large independent
+ * subtrees at the same time. A task is forked onto the deque of the thread
+ * that creates it and other threads steal it from the far end if they are
+ * idle. A thread that joins a task that has not finished runs other tasks
+ * while it waits, so a join never blocks a thread that could be working.
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "value.h"
+
+typedef struct _task_t_ {
+    void (*func)(struct _task_t_* task);
+    void* data;
+    value_t result;
+    int errors;         // counted while it ran, given to the joining thread
+    atomic_int done;
+} task_t;
+
+void start_pool(int threads);
+bool pool_is_running();
+int pool_threads();
+void fork_task(task_t* task);
+void join_task(task_t* task);
+
+#endif
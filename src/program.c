@@ -0,0 +1,113 @@
+/*
+ * When a script is read with the compile option, the parser adds each
+ * statement here instead of running it. The statements are then run as one
+ * program, either as they are or after being compiled.
+ */
+#include <stdio.h>
+
+#include "ast.h"
+#include "program.h"
+#include "job.h"
+#include "session.h"
+#include "memo.h"
+#include "memory.h"
+#include "error.h"
+
+/*
+ * Create an empty program.
+ */
+program_t* create_program() {
+
+    program_t* prog = ALLOC_DS(program_t);
+    prog->cap = 0x40;
+    prog->list = ALLOC_LST(prog->cap, ast_t*);
+
+    return prog;
+}
+
+/*
+ * Free the statements and leave the program empty.
+ */
+void clear_program(program_t* prog) {
+
+    for(int i = 0; i < prog->len; i++)
+        destroy_ast(prog->list[i]);
+    prog->len = 0;
+}
+
+/*
+ * Free the program and all of the statements in it.
+ */
+void destroy_program(program_t* prog) {
+
+    clear_program(prog);
+    FREE(prog->list);
+    FREE(prog);
+}
+
+/*
+ * Add a statement to the end of the program.
+ */
+void add_statement(program_t* prog, ast_t* stmt) {
+
+    if(prog->len + 1 > prog->cap) {
+        prog->cap <<= 1;
+        prog->list = REALLOC_LST(prog->list, prog->cap, ast_t*);
+    }
+
+    prog->list[prog->len++] = stmt;
+}
+
+/*
+ * Run a single assignment or print statement. A print whose result is in the
+ * cache is not evaluated. A result is only saved when it was not cancelled
+ * and there were no errors.
+ */
+void execute_statement(ast_t* stmt) {
+
+    int64_t start = stage_timing? now_ns() : 0;
+
+    if(stmt->value.op->op == PRINT_OP) {
+        value_t val;
+        if(!find_memo(stmt->left, &val)) {
+            int errors = get_errors();
+            val = traverse_ast(stmt);
+            if(!atomic_load(&job_cancel) && get_errors() == errors)
+                save_memo(stmt->left, val);
+        }
+        if(stage_timing) {
+            int64_t now = now_ns();
+            stage_ns[EVAL_STAGE] += now - start;
+            start = now;
+        }
+        if(!atomic_load(&job_cancel))
+            print_value("Result: ", val);
+        release_value(val);
+        if(stage_timing)
+            stage_ns[PRINT_STAGE] += now_ns() - start;
+    }
+    else {
+        traverse_ast(stmt);
+        if(stage_timing)
+            stage_ns[EVAL_STAGE] += now_ns() - start;
+    }
+}
+
+/*
+ * Run the statements in order, the same as if they were typed in. Each one
+ * starts with no errors, so one that fails does not stop the rest, and their
+ * errors are added to the count of the caller.
+ */
+void run_program(program_t* prog) {
+
+    msg(1, "Run the program");
+    int errors = get_errors();
+    for(int i = 0; i < prog->len; i++) {
+        reset_errors();
+        execute_statement(prog->list[i]);
+        errors += get_errors();
+    }
+
+    reset_errors();
+    add_errors(errors);
+}
@@ -0,0 +1,23 @@
+/*
+ * A program is the list of statements from a whole script, kept so that the
+ * script can be run as one unit instead of a line at a time.
+ */
+#ifndef __PROGRAM_H__
+#define __PROGRAM_H__
+
+#include "ast.h"
+
+typedef struct {
+    ast_t** list;
+    int len;
+    int cap;
+} program_t;
+
+program_t* create_program();
+void destroy_program(program_t* prog);
+void add_statement(program_t* prog, ast_t* stmt);
+void clear_program(program_t* prog);
+void execute_statement(ast_t* stmt);
+void run_program(program_t* prog);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * Session logs.
+ *
+ * The log is a header line followed by one line for each input line:
+ *
+ *     offset<TAB>status<TAB>elapsed<TAB>input
+ *
+ * The offset is the time from the start of the session to when the line was
+ * run and the elapsed time is how long it took, both in microseconds. The
+ * status is the number of errors, or -1 if the line was cancelled.
+ *
+ * A replay runs each line with stage timing turned on. The scanner, the
+ * commands and the statement code add their time to stage_ns, as does the
+ * constant folding that the parser does as it builds the tree. The time that
+ * is left over is the parser's.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "session.h"
+#include "memory.h"
+
+#define LOG_HEADER  "# calc session log v1"
+
+typedef struct {
+    int64_t* list;
+    int len;
+    int cap;
+} samples_t;
+
+bool stage_timing = false;
+int64_t stage_ns[NUM_STAGES];
+
+extern atomic_int quit_flag;
+
+static FILE* log_fp = NULL;
+static int64_t log_start = 0;
+
+int64_t now_ns() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Start recording the session to the file.
+ */
+void open_log(const char* fname) {
+
+    log_fp = fopen(fname, "w");
+    if(log_fp == NULL) {
+        fprintf(stderr, "cannot open log: %s\n", fname);
+        exit(1);
+    }
+
+    fprintf(log_fp, "%s\n", LOG_HEADER);
+    log_start = now_ns();
+}
+
+/*
+ * Add a line to the log, if there is one. The log is flushed every time, so
+ * it is complete up to the last line even if the calculator dies.
+ */
+void log_line(const char* line, int64_t start, int status, int64_t elapsed) {
+
+    if(log_fp == NULL)
+        return;
+
+    fprintf(log_fp, "%" PRId64 "\t%d\t%" PRId64 "\t%s\n",
+            (start - log_start) / 1000, status, elapsed / 1000, line);
+    fflush(log_fp);
+}
+
+void close_log() {
+
+    if(log_fp != NULL) {
+        fclose(log_fp);
+        log_fp = NULL;
+    }
+}
+
+static void add_sample(samples_t* s, int64_t val) {
+
+    if(s->len + 1 > s->cap) {
+        s->cap = (s->cap == 0)? 0x100 : s->cap << 1;
+        s->list = (s->list == NULL)? ALLOC_LST(s->cap, int64_t) :
+                                    REALLOC_LST(s->list, s->cap, int64_t);
+    }
+
+    s->list[s->len++] = val;
+}
+
+static int compare(const void* a, const void* b) {
+
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_samples(const char* name, samples_t* s) {
+
+    if(s->len == 0)
+        return;
+
+    qsort(s->list, s->len, sizeof(int64_t), compare);
+    printf("%-8s %12.1f %12.1f %12.1f\n", name,
+            s->list[(s->len - 1) / 2] / 1000.0,
+            s->list[(int)((s->len - 1) * 0.99)] / 1000.0,
+            s->list[s->len - 1] / 1000.0);
+}
+
+/*
+ * Run the lines of a log and print the latency of each stage. If paced is
+ * set, then each line waits for its time from the start of the session, so
+ * the replay takes as long as the session did. Otherwise the lines run one
+ * after another as fast as they can.
+ */
+void replay_log(const char* fname, bool paced, int (*run)(const char*)) {
+
+    FILE* fp = fopen(fname, "r");
+    if(fp == NULL) {
+        fprintf(stderr, "cannot open log: %s\n", fname);
+        exit(1);
+    }
+
+    char* buf = NULL;
+    size_t size = 0;
+    if(getline(&buf, &size, fp) <= 0 || strncmp(buf, LOG_HEADER, strlen(LOG_HEADER)) != 0) {
+        fprintf(stderr, "not a session log: %s\n", fname);
+        exit(1);
+    }
+
+    samples_t samples[NUM_STAGES + 1];
+    memset(samples, 0, sizeof(samples));
+    int lines = 0;
+    int changed = 0;
+    int64_t last = 0;
+    int64_t start = now_ns();
+    stage_timing = true;
+
+    while(!atomic_load(&quit_flag) && getline(&buf, &size, fp) > 0) {
+        char* p = buf;
+        int64_t offset = strtoll(p, &p, 10);
+        int status = (int)strtol(p, &p, 10);
+        strtoll(p, &p, 10);
+        if(*p != '\t') {
+            fprintf(stderr, "bad line in session log: %s", buf);
+            continue;
+        }
+        char* line = p + 1;
+        line[strcspn(line, "\n")] = '\0';
+        last = offset;
+
+        if(paced) {
+            int64_t when = start + offset * 1000;
+            struct timespec ts = { when / 1000000000, when % 1000000000 };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        memset(stage_ns, 0, sizeof(stage_ns));
+        int64_t t = now_ns();
+        if(run(line) != status)
+            changed++;
+        t = now_ns() - t;
+
+        stage_ns[PARSE_STAGE] = t - stage_ns[SCAN_STAGE] - stage_ns[COMMAND_STAGE] -
+                stage_ns[EVAL_STAGE] - stage_ns[PRINT_STAGE];
+        for(int i = 0; i < NUM_STAGES; i++)
+            add_sample(&samples[i], stage_ns[i]);
+        add_sample(&samples[NUM_STAGES], t);
+        lines++;
+    }
+
+    stage_timing = false;
+    double secs = (now_ns() - start) * 1e-9;
+    free(buf);
+    fclose(fp);
+
+    printf("\nReplayed %d lines in %0.3fs (the session took %0.3fs)\n", lines, secs, last * 1e-6);
+    printf("%-8s %12s %12s %12s\n", "stage", "p50 us", "p99 us", "max us");
+    for(int i = 0; i <= NUM_STAGES; i++) {
+        print_samples(STAGE_TOSTR(i), &samples[i]);
+        if(samples[i].list != NULL)
+            FREE(samples[i].list);
+    }
+    if(changed > 0)
+        printf("%d line%s had a different outcome than when recorded\n",
+                changed, (changed == 1)? "" : "s");
+}
@@ -0,0 +1,41 @@
+/*
+ * Session logs. Every line typed at the prompt can be written to a log with
+ * the time it was entered, how it turned out and how long it took. A log can
+ * be replayed later as a benchmark, which times each line by stage.
+ */
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    SCAN_STAGE,
+    PARSE_STAGE,
+    COMMAND_STAGE,  // commands such as grad and import, run as they are parsed
+    EVAL_STAGE,
+    PRINT_STAGE,
+    NUM_STAGES,
+} stage_t;
+
+#define STAGE_TOSTR(s) (\
+    ((s) == SCAN_STAGE)? "scan" : \
+    ((s) == PARSE_STAGE)? "parse" : \
+    ((s) == COMMAND_STAGE)? "command" : \
+    ((s) == EVAL_STAGE)? "eval" : \
+    ((s) == PRINT_STAGE)? "print" : "total")
+
+// the status of a line is the number of errors, or CANCELLED
+#define CANCELLED   -1
+
+extern bool stage_timing;
+extern int64_t stage_ns[NUM_STAGES];
+
+int64_t now_ns();
+void open_log(const char* fname);
+void log_line(const char* line, int64_t start, int status, int64_t elapsed);
+void close_log();
+void replay_log(const char* fname, bool paced, int (*run)(const char*));
+
+#endif
@@ -0,0 +1,401 @@
+/*
+ * Streaming statistics.
+ *
+ * The input is read in chunks of up to READ_SIZE bytes, taking whatever a
+ * pipe has ready, and the numbers are parsed straight out of the buffer,
+ * without the scanner or the parser. Anything that cannot be part of a
+ * number separates numbers. Parsed numbers are collected in a block
+ * and each block is folded into the totals at once: the block mean and sum of
+ * squares are found in two passes over the block while it is in the cache
+ * and are merged with the running values (Chan et al.), which gives the same
+ * result as Welford's update without a divide for every number.
+ *
+ * Quantiles come from a log scale histogram. Each power of two is split into
+ * SUB_COUNT buckets, so a quantile is within about 1% of the true value. The
+ * histogram is a fixed size and an update is one increment.
+ *
+ * If there is an expression, then each number is assigned to x and the value
+ * of the expression is used instead. Results that are not a number are
+ * dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "memory.h"
+#include "error.h"
+#include "symbols.h"
+
+#define READ_SIZE   0x100000    // most bytes read at a time
+#define BLOCK_SIZE  0x1000      // numbers folded in at a time
+#define CLOCK_EVERY 0x10        // blocks between looks at the clock
+
+#define SUB_BITS    6
+#define SUB_COUNT   (1 << SUB_BITS)
+#define EXP_COUNT   128         // powers of two kept, 2^-64 to 2^63
+#define EXP_BASE    (1023 - EXP_COUNT / 2)
+#define HALF_SIZE   (EXP_COUNT * SUB_COUNT)
+#define ZERO_BUCKET HALF_SIZE   // negatives below, positives above
+
+typedef struct {
+    int64_t count;
+    double mean;
+    double m2;          // sum of squared differences from the mean
+    double min;
+    double max;
+    int64_t* buckets;   // HALF_SIZE * 2 + 1
+} stream_t;
+
+static const char* quantile_names[] = { "stream_p50", "stream_p90", "stream_p99" };
+static const double quantiles[] = { 0.50, 0.90, 0.99 };
+#define NUM_QUANTILES (int)(sizeof(quantiles) / sizeof(quantiles[0]))
+
+static const double pow10_tab[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Histogram bucket of a number greater than zero. Numbers outside of the
+ * range go in the end buckets.
+ */
+static inline int bucket_of(double v) {
+
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    int e = (int)(bits >> 52) - EXP_BASE;
+    if(e < 0)
+        return 0;
+    if(e >= EXP_COUNT)
+        return HALF_SIZE - 1;
+    return (e << SUB_BITS) | (int)((bits >> (52 - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/*
+ * The middle of a bucket from bucket_of().
+ */
+static double bucket_value(int idx) {
+
+    double frac = 1.0 + ((idx & (SUB_COUNT - 1)) + 0.5) / SUB_COUNT;
+    return ldexp(frac, (idx >> SUB_BITS) + EXP_BASE - 1023);
+}
+
+/*
+ * Fold a block of numbers into the totals.
+ */
+static void add_block(stream_t* st, const double* block, int n) {
+
+    if(n == 0)
+        return;
+
+    double sum = 0.0;
+    double min = st->min;
+    double max = st->max;
+    for(int i = 0; i < n; i++) {
+        double v = block[i];
+        sum += v;
+        min = (v < min)? v : min;
+        max = (v > max)? v : max;
+        if(v > 0.0)
+            st->buckets[ZERO_BUCKET + 1 + bucket_of(v)]++;
+        else if(v < 0.0)
+            st->buckets[ZERO_BUCKET - 1 - bucket_of(-v)]++;
+        else
+            st->buckets[ZERO_BUCKET]++;
+    }
+
+    double mean = sum / n;
+    double m2 = 0.0;
+    for(int i = 0; i < n; i++)
+        m2 += (block[i] - mean) * (block[i] - mean);
+
+    double total = (double)(st->count + n);
+    double delta = mean - st->mean;
+    st->mean += delta * n / total;
+    st->m2 += m2 + delta * delta * ((double)st->count * n / total);
+    st->count += n;
+    st->min = min;
+    st->max = max;
+}
+
+static double quantile(stream_t* st, double q) {
+
+    if(st->count == 0)
+        return NAN;
+
+    int64_t rank = (int64_t)ceil(q * st->count);
+    if(rank < 1)
+        rank = 1;
+
+    int64_t seen = 0;
+    int idx;
+    for(idx = 0; idx < HALF_SIZE * 2; idx++) {
+        seen += st->buckets[idx];
+        if(seen >= rank)
+            break;
+    }
+
+    double val = (idx == ZERO_BUCKET)? 0.0 :
+                    (idx > ZERO_BUCKET)? bucket_value(idx - ZERO_BUCKET - 1) :
+                    -bucket_value(ZERO_BUCKET - 1 - idx);
+
+    // the end buckets are open and the min and max are exact
+    return (val < st->min)? st->min : (val > st->max)? st->max : val;
+}
+
+static double variance(stream_t* st) {
+
+    return (st->count > 1)? st->m2 / (st->count - 1) : 0.0;
+}
+
+static void print_snapshot(stream_t* st, double secs) {
+
+    fprintf(stderr, "[%0.1fs] count: %" PRId64 " mean: %0.3f sd: %0.3f min: %0.3f max: %0.3f",
+                    secs, st->count, st->mean, sqrt(variance(st)), st->min, st->max);
+    for(int i = 0; i < NUM_QUANTILES; i++)
+        fprintf(stderr, " %s: %0.3f", quantile_names[i] + 7, quantile(st, quantiles[i]));
+    fprintf(stderr, "\n");
+}
+
+/*
+ * Separators are anything that cannot be part of a number.
+ */
+static inline int is_sep(char c) {
+
+    return !((c >= '0' && c <= '9') || c == '.' || c == '-' ||
+            c == '+' || c == 'e' || c == 'E');
+}
+
+/*
+ * Parse the number at s and return the first character after it, or NULL if
+ * there is no number. Up to 19 significant digits and a power of ten that is
+ * exact as a double are done with one multiply or divide, which is correctly
+ * rounded. Anything else goes to strtod().
+ */
+static const char* parse_number(const char* s, double* out) {
+
+    const char* p = s;
+    bool neg = false;
+    if(*p == '-' || *p == '+')
+        neg = (*p++ == '-');
+
+    uint64_t mant = 0;
+    int digits = 0;
+    int exp10 = 0;
+    bool any = false;
+    bool exact = true;
+
+    for(; *p >= '0' && *p <= '9'; p++) {
+        any = true;
+        if(digits < 19) {
+            mant = mant * 10 + (*p - '0');
+            digits += (mant != 0);
+        }
+        else {
+            exp10++;
+            exact = false;
+        }
+    }
+
+    if(*p == '.') {
+        for(p++; *p >= '0' && *p <= '9'; p++) {
+            any = true;
+            if(digits < 19) {
+                mant = mant * 10 + (*p - '0');
+                digits += (mant != 0);
+                exp10--;
+            }
+            else
+                exact = false;
+        }
+    }
+
+    if(!any)
+        return NULL;
+
+    if(*p == 'e' || *p == 'E') {
+        const char* q = p + 1;
+        bool eneg = false;
+        if(*q == '-' || *q == '+')
+            eneg = (*q++ == '-');
+        if(*q >= '0' && *q <= '9') {
+            int e = 0;
+            for(; *q >= '0' && *q <= '9'; q++)
+                if(e < 10000)
+                    e = e * 10 + (*q - '0');
+            exp10 += eneg? -e : e;
+            p = q;
+        }
+    }
+
+    if(exact && mant < (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        double val = (double)mant;
+        val = (exp10 < 0)? val / pow10_tab[-exp10] : val * pow10_tab[exp10];
+        *out = neg? -val : val;
+    }
+    else
+        *out = strtod(s, NULL);
+
+    return p;
+}
+
+static double elapsed(struct timespec* start) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/*
+ * Set the results as read only symbols.
+ */
+static void publish(stream_t* st) {
+
+    set_read_only("stream_count", INT_VALUE(st->count));
+    set_read_only("stream_mean", FLOAT_VALUE((st->count > 0)? st->mean : NAN));
+    set_read_only("stream_var", FLOAT_VALUE(variance(st)));
+    set_read_only("stream_sd", FLOAT_VALUE(sqrt(variance(st))));
+    set_read_only("stream_min", FLOAT_VALUE((st->count > 0)? st->min : NAN));
+    set_read_only("stream_max", FLOAT_VALUE((st->count > 0)? st->max : NAN));
+    for(int i = 0; i < NUM_QUANTILES; i++)
+        set_read_only(quantile_names[i], FLOAT_VALUE(quantile(st, quantiles[i])));
+}
+
+/*
+ * Read every number in the file and set the stream_* symbols. If interval
+ * is not zero, then a snapshot goes to stderr about that many seconds apart.
+ */
+void run_stream(FILE* fp, ast_t* expr, double interval) {
+
+    msg(1, "Read a stream of numbers");
+    stream_t st;
+    st.count = 0;
+    st.mean = 0.0;
+    st.m2 = 0.0;
+    st.min = INFINITY;
+    st.max = -INFINITY;
+    st.buckets = ALLOC_LST(HALF_SIZE * 2 + 1, int64_t);
+
+    char* buf = ALLOC(READ_SIZE + 1);
+    double* block = ALLOC_LST(BLOCK_SIZE, double);
+    size_t have = 0;
+    int len = 0;
+    int blocks = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double next = interval;
+
+    for(;;) {
+        // read() returns what is there, so a slow pipe is not held up
+        // until a whole buffer arrives
+        ssize_t n = read(fileno(fp), buf + have, READ_SIZE - have);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0) {
+            error("cannot read the stream");
+            n = 0;
+        }
+        bool eof = (n == 0);
+        have += n;
+
+        // Only go up to the last separator, so a number that is cut off by
+        // the end of the buffer is finished by the next read. Text with no
+        // separator in it is kept for the next read, unless it fills the
+        // whole buffer.
+        size_t cut = have;
+        if(!eof) {
+            while(cut > 0 && !is_sep(buf[cut - 1]))
+                cut--;
+            if(cut == 0 && have == READ_SIZE)
+                cut = have;
+        }
+        buf[have] = '\0';
+
+        const char* p = buf;
+        const char* end = buf + cut;
+        while(p < end) {
+            double v;
+            const char* q = is_sep(*p)? NULL : parse_number(p, &v);
+            if(q == NULL) {
+                p++;
+                continue;
+            }
+            p = q;
+
+            if(expr != NULL) {
+                assign_symbol("x", FLOAT_VALUE(v));
+                v = value_to_double(expr->visit(expr));
+                if(isnan(v))
+                    continue;
+            }
+
+            block[len++] = v;
+            if(len == BLOCK_SIZE) {
+                add_block(&st, block, len);
+                len = 0;
+                if(interval > 0.0 && ++blocks % CLOCK_EVERY == 0) {
+                    double secs = elapsed(&start);
+                    if(secs >= next) {
+                        print_snapshot(&st, secs);
+                        next = secs + interval;
+                    }
+                }
+            }
+        }
+
+        memmove(buf, buf + cut, have - cut);
+        have -= cut;
+        if(eof)
+            break;
+
+        // the clock is also looked at after every read, so a slow stream
+        // gets its snapshots even when it takes a long time to fill a block
+        if(interval > 0.0) {
+            double secs = elapsed(&start);
+            if(secs >= next) {
+                add_block(&st, block, len);
+                len = 0;
+                print_snapshot(&st, secs);
+                next = secs + interval;
+            }
+        }
+    }
+
+    add_block(&st, block, len);
+    msg(1, "Read %" PRId64 " numbers in %0.3f seconds", st.count, elapsed(&start));
+    publish(&st);
+
+    FREE(block);
+    FREE(buf);
+    FREE(st.buckets);
+}
+
+/*
+ * Print the stream_* symbols.
+ */
+void print_stream() {
+
+    static const char* names[] = { "stream_count", "stream_mean", "stream_var",
+                                    "stream_sd", "stream_min", "stream_max" };
+    value_t val;
+
+    for(int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+        if(SYM_NO_ERROR == find_symbol(names[i], &val)) {
+            printf("%s: ", names[i]);
+            print_value("", val);
+        }
+
+    for(int i = 0; i < NUM_QUANTILES; i++)
+        if(SYM_NO_ERROR == find_symbol(quantile_names[i], &val)) {
+            printf("%s: ", quantile_names[i]);
+            print_value("", val);
+        }
+}
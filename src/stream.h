@@ -0,0 +1,17 @@
+/*
+ * Streaming statistics. Numbers are read from a file, usually stdin, and are
+ * folded into running statistics that take the same memory no matter how
+ * many numbers there are. When the input ends the results are set as read
+ * only symbols.
+ */
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <stdio.h>
+
+#include "ast.h"
+
+void run_stream(FILE* fp, ast_t* expr, double interval);
+void print_stream();
+
+#endif
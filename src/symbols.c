@@ -1,27 +1,41 @@
 /**
- * Symbols are stored in a binary tree because it's quick and easy. There
- * will never more than a couple of hundred symbols, one would think.
- * Different storage and retrieval techniques are not going to make much
- * difference.
+ * Symbols are found by name in a hash table. They are also kept in a binary
+ * tree in name order, which is only used to list them. The tree is kept
+ * balanced as a scapegoat tree: when an insert lands too deep, the subtree
+ * under the lowest ancestor that is out of balance is rebuilt. Rebuilding
+ * only relinks the nodes, so a symbol never moves and a handle to it stays
+ * good. There are no deletes.
+ *
+ * Listing the symbols that start with a prefix walks the tree from the first
+ * name that is not less than the prefix and stops at the first name that does
+ * not start with it, so the cost is the height of the tree plus the number of
+ * names listed.
  */
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <inttypes.h>
+#include <fnmatch.h>
+#include <math.h>
 
 #include "memory.h"
 #include "error.h"
 #include "symbols.h"
+#include "array.h"
+#include "job.h"
 
-typedef struct _ste_t_ {
-    const char* name;
-    double value;
-    bool is_assigned;
-    struct _ste_t_* left;
-    struct _ste_t_* right;
-} symbol_table_t;
+// the height of the tree is at most log base 1/ALPHA of the size
+#define ALPHA       (2.0 / 3.0)
+#define MAX_HEIGHT  128
+#define OUT_SIZE    (64 * 1024)
 
 // global symbol table
 static symbol_table_t* root = NULL;
+static symbol_table_t** buckets = NULL;
+static int nbuckets = 0;
+static int nsymbols = 0;
 
 /*
  * Duplicate the string.
@@ -34,77 +48,311 @@ static const char* dupstr(const char* str) {
     return buf;
 }
 
+static int count_nodes(symbol_table_t* node) {
+
+    return (node == NULL)? 0 : count_nodes(node->left) + count_nodes(node->right) + 1;
+}
+
+static int flatten(symbol_table_t* node, symbol_table_t** list, int pos) {
+
+    if(node == NULL)
+        return pos;
+
+    pos = flatten(node->left, list, pos);
+    list[pos++] = node;
+    return flatten(node->right, list, pos);
+}
+
+static symbol_table_t* build(symbol_table_t** list, int len) {
+
+    if(len == 0)
+        return NULL;
+
+    int mid = len / 2;
+    list[mid]->left = build(list, mid);
+    list[mid]->right = build(list + mid + 1, len - mid - 1);
+    return list[mid];
+}
+
+/*
+ * Rebuild the subtree at the link as a perfectly balanced tree.
+ */
+static void rebuild(symbol_table_t** link, int size) {
+
+    symbol_table_t** list = ALLOC_LST(size, symbol_table_t*);
+    flatten(*link, list, 0);
+    *link = build(list, size);
+    FREE(list);
+}
+
+static uint32_t hash_name(const char* name, size_t len) {
+
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+
+    return h;
+}
+
 /**
- * Recursively add the symbol to the tree.
+ * Find a symbol by a name that is len characters long and has the hash h.
  */
-static symbols_error_t recursive_add(symbol_table_t* root, symbol_table_t* node) {
+static symbol_table_t* find_hashed(const char* name, size_t len, uint32_t h) {
 
-    if(strcmp(root->name, node->name) < 0) {
-        if(root->left == NULL) {
-            root->left = node;
-            return SYM_NO_ERROR;
+    if(nbuckets == 0)
+        return NULL;
+
+    symbol_table_t* node = buckets[h & (nbuckets - 1)];
+    while(node != NULL && (strncmp(name, node->name, len) != 0 || node->name[len] != '\0'))
+        node = node->next;
+
+    return node;
+}
+
+static symbol_table_t* find_node(const char* name) {
+
+    size_t len = strlen(name);
+    return find_hashed(name, len, hash_name(name, len));
+}
+
+/*
+ * Make sure that there are enough buckets for count symbols.
+ */
+static void grow_hash(int count) {
+
+    if(count <= nbuckets)
+        return;
+
+    int size = (nbuckets == 0)? 0x100 : nbuckets;
+    while(size < count)
+        size <<= 1;
+
+    symbol_table_t** list = ALLOC_LST(size, symbol_table_t*);
+    for(int i = 0; i < nbuckets; i++) {
+        symbol_table_t* sym = buckets[i];
+        while(sym != NULL) {
+            symbol_table_t* next = sym->next;
+            uint32_t h = hash_name(sym->name, strlen(sym->name)) & (size - 1);
+            sym->next = list[h];
+            list[h] = sym;
+            sym = next;
         }
-        else
-            return recursive_add(root->left, node);
     }
-    else if(strcmp(root->name, node->name) > 0) {
-        if(root->right == NULL) {
-            root->right = node;
-            return SYM_NO_ERROR;
-        }
-        else
-            return recursive_add(root->right, node);
+
+    if(buckets != NULL)
+        FREE(buckets);
+    buckets = list;
+    nbuckets = size;
+}
+
+static void link_hash(symbol_table_t* node, uint32_t h) {
+
+    node->next = buckets[h & (nbuckets - 1)];
+    buckets[h & (nbuckets - 1)] = node;
+}
+
+/**
+ * Add the node to the tree, then rebuild part of the tree if the new node is
+ * too deep. The node is already counted in nsymbols.
+ */
+static void tree_insert(symbol_table_t* node) {
+
+    symbol_table_t** path[MAX_HEIGHT];
+    symbol_table_t** link = &root;
+    int depth = 0;
+
+    while(*link != NULL) {
+        path[depth++] = link;
+        link = (strcmp(node->name, (*link)->name) < 0)? &(*link)->left : &(*link)->right;
     }
-    else {
-        return SYM_EXISTS;  // node exists.
+
+    *link = node;
+    if(depth <= (int)(log(nsymbols) / log(1.0 / ALPHA)))
+        return;
+
+    // find the lowest ancestor with a child that is too big for it
+    int size = 1;
+    symbol_table_t* child = node;
+    for(int i = depth - 1; i >= 0; i--) {
+        symbol_table_t* parent = *path[i];
+        int total = size + 1 + count_nodes((parent->left == child)? parent->right : parent->left);
+        if(size > ALPHA * total) {
+            rebuild(path[i], total);
+            break;
+        }
+        size = total;
+        child = parent;
     }
 }
 
 /**
- * Recursively find a symbol in the tree.
+ * Add the symbol to the table and the tree.
  */
-static symbol_table_t* recursive_find(symbol_table_t* root, const char* name) {
+static symbols_error_t insert_node(symbol_table_t* node) {
 
-    if(root != NULL) {
-        if(strcmp(root->name, name) < 0) {
-            if(root->left == NULL)
-                return NULL;
-            else
-                return recursive_find(root->left, name);
+    size_t len = strlen(node->name);
+    uint32_t h = hash_name(node->name, len);
+    if(find_hashed(node->name, len, h) != NULL)
+        return SYM_EXISTS;
 
+    grow_hash(nsymbols + 1);
+    link_hash(node, h);
+    nsymbols++;
+    tree_insert(node);
+
+    return SYM_NO_ERROR;
+}
+
+typedef struct {
+    uint64_t key;           // the first 8 bytes of the name
+    symbol_table_t* sym;
+} sort_item_t;
+
+static int compare_tails(const void* a, const void* b) {
+
+    return strcmp(((const sort_item_t*)a)->sym->name + 8, ((const sort_item_t*)b)->sym->name + 8);
+}
+
+/*
+ * Sort the nodes by name. The first 8 bytes of each name are a number that
+ * is radix sorted, so most of the sort does not look at the names at all.
+ * Names that start with the same 8 bytes are then sorted by the rest.
+ */
+static void sort_nodes(symbol_table_t** list, int count) {
+
+    sort_item_t* items = ALLOC_LST(count, sort_item_t);
+    sort_item_t* tmp = ALLOC_LST(count, sort_item_t);
+
+    for(int i = 0; i < count; i++) {
+        const char* name = list[i]->name;
+        uint64_t key = 0;
+        for(int j = 0; j < 8; j++) {
+            key = (key << 8) | (unsigned char)*name;
+            name += (*name != '\0');
         }
-        else if(strcmp(root->name, name) > 0) {
-            if(root->right == NULL)
-                return NULL;
-            else
-                return recursive_find(root->right, name);
-        }
-        else
-            return root;
+        items[i].key = key;
+        items[i].sym = list[i];
+    }
+
+    for(int shift = 0; shift < 64; shift += 8) {
+        int counts[257] = { 0 };
+        for(int i = 0; i < count; i++)
+            counts[((items[i].key >> shift) & 0xff) + 1]++;
+        if(counts[((items[0].key >> shift) & 0xff) + 1] == count)
+            continue;   // every name has the same byte here
+
+        for(int i = 1; i <= 256; i++)
+            counts[i] += counts[i - 1];
+        for(int i = 0; i < count; i++)
+            tmp[counts[(items[i].key >> shift) & 0xff]++] = items[i];
+
+        sort_item_t* swap = items;
+        items = tmp;
+        tmp = swap;
+    }
+
+    // the names in a run with the same key are all at least 8 bytes long
+    for(int i = 0; i < count; ) {
+        int j = i + 1;
+        while(j < count && items[j].key == items[i].key)
+            j++;
+        if(j - i > 1)
+            qsort(items + i, j - i, sizeof(sort_item_t), compare_tails);
+        i = j;
     }
 
-    return NULL;
+    for(int i = 0; i < count; i++)
+        list[i] = items[i].sym;
+
+    FREE(items);
+    FREE(tmp);
 }
 
-/**
- * Recursively dump the symbol table.
+/*
+ * Merge the new nodes, which are sorted, into the tree. A few are inserted
+ * one at a time. More than that and the whole tree is rebuilt from the
+ * merged list, which leaves it perfectly balanced.
  */
-static void recursive_dump(symbol_table_t* node) {
+static void merge_nodes(symbol_table_t** list, int count) {
 
-    if(node != NULL) {
-        if(node->left != NULL) {
-            recursive_dump(node->left);
-        }
+    int old = nsymbols - count;
+    if(count < old / 16) {
+        for(int i = 0; i < count; i++)
+            tree_insert(list[i]);
+        return;
+    }
 
-        if(node->right != NULL) {
-            recursive_dump(node->right);
-        }
+    symbol_table_t** nodes = ALLOC_LST(old + 1, symbol_table_t*);
+    symbol_table_t** all = ALLOC_LST(nsymbols, symbol_table_t*);
+    flatten(root, nodes, 0);
 
-        if(node->is_assigned)
-            printf("name: %s value = %0.3f\n", node->name, node->value);
-        else
-            printf("name: %s value = not assigned\n", node->name);
+    int i = 0, j = 0, k = 0;
+    while(i < old && j < count)
+        all[k++] = (strcmp(nodes[i]->name, list[j]->name) < 0)? nodes[i++] : list[j++];
+    while(i < old)
+        all[k++] = nodes[i++];
+    while(j < count)
+        all[k++] = list[j++];
+
+    root = build(all, nsymbols);
+    FREE(nodes);
+    FREE(all);
+}
+
+/*
+ * The listing is written to one large buffer, so a long listing is a few
+ * writes instead of one for each symbol.
+ */
+typedef struct {
+    char buf[OUT_SIZE];
+    size_t len;
+} output_t;
+
+static void out_flush(output_t* out) {
+
+    fwrite(out->buf, 1, out->len, stdout);
+    out->len = 0;
+}
+
+/*
+ * A line that does not fit in what is left of the buffer, which only a very
+ * long name does, is written straight to stdout after the buffer.
+ */
+static void out_printf(output_t* out, const char* fmt, ...) {
+
+    va_list args, again;
+
+    if(out->len + 512 > OUT_SIZE)
+        out_flush(out);
+
+    va_start(args, fmt);
+    va_copy(again, args);
+    int len = vsnprintf(out->buf + out->len, OUT_SIZE - out->len, fmt, args);
+    va_end(args);
+
+    if(len >= 0 && (size_t)len < OUT_SIZE - out->len)
+        out->len += len;
+    else {
+        out_flush(out);
+        vprintf(fmt, again);
     }
+    va_end(again);
+}
+
+static void out_symbol(output_t* out, symbol_table_t* node) {
+
+    char buf[DECIMAL_SIZE];
+
+    if(!node->is_assigned)
+        out_printf(out, "name: %s value = not assigned\n", node->name);
+    else if(node->value.type == INT_VAL)
+        out_printf(out, "name: %s value = %" PRId64 "\n", node->name, node->value.ival);
+    else if(node->value.type == DEC_VAL)
+        out_printf(out, "name: %s value = %s\n", node->name, format_decimal(buf, node->value));
+    else if(node->value.type == ARRAY_VAL)
+        out_printf(out, "name: %s value = array[%" PRId64 "]\n", node->name, node->value.aval->len);
+    else
+        out_printf(out, "name: %s value = %0.*f\n", node->name, FLOAT_DIGITS, node->value.fval);
 }
 
 /**
@@ -118,37 +366,153 @@ symbols_error_t add_symbol(const char* name) { //, double val, bool flag) {
     //node->value = val;
     //node->is_assigned = flag;
 
-    if(root == NULL) {
-        root = node;
-        return SYM_NO_ERROR;
+    symbols_error_t err = insert_node(node);
+    if(err != SYM_NO_ERROR) {
+        FREE((void*)node->name);
+        FREE(node);
     }
-    else
-        return recursive_add(root, node);
+
+    return err;
 }
 
 /**
- * Assign a value to the symbol. If it is not found then return !0. Else
- * return 0.
+ * Add a batch of names and assign their values in order, so the last value
+ * for a name wins. A name that exists is assigned the same as it would be by
+ * assign_symbol(). The new symbols are allocated in one block and are added
+ * to the tree all at once. Return the number of names that could not be
+ * assigned because they are read only.
  */
-symbols_error_t assign_symbol(const char* name, double val) {
+int add_symbols(sym_entry_t* list, int count) {
 
-    symbol_table_t* sym = recursive_find(root, name);
-    if(sym != NULL) {
-        sym->value = val;
-        sym->is_assigned = true;
-        return SYM_NO_ERROR;
+    uint32_t* hashes = ALLOC_LST(count + 1, uint32_t);
+    int* fresh = ALLOC_LST(count + 1, int);
+    int nfresh = 0;
+    size_t bytes = 0;
+    int errors = 0;
+
+    // assign the names that exist and count what the new ones need
+    for(int i = 0; i < count; i++) {
+        hashes[i] = hash_name(list[i].name, list[i].len);
+        symbol_table_t* sym = find_hashed(list[i].name, list[i].len, hashes[i]);
+        if(sym != NULL)
+            errors += (assign_handle(sym, list[i].val) == SYM_READ_ONLY);
+        else {
+            fresh[nfresh++] = i;
+            bytes += sizeof(symbol_table_t) + ((list[i].len + 8) & ~(size_t)7);
+        }
     }
 
+    char* block = (nfresh > 0)? ALLOC(bytes) : NULL;
+    symbol_table_t** added = ALLOC_LST(nfresh + 1, symbol_table_t*);
+    int nadded = 0;
+    grow_hash(nsymbols + nfresh);
+
+    // a name can be new and still be in the batch more than once
+    for(int n = 0; n < nfresh; n++) {
+        sym_entry_t* ent = &list[fresh[n]];
+        symbol_table_t* sym = find_hashed(ent->name, ent->len, hashes[fresh[n]]);
+        if(sym == NULL) {
+            sym = (symbol_table_t*)block;
+            char* name = (char*)(sym + 1);
+            memcpy(name, ent->name, ent->len);
+            name[ent->len] = '\0';
+            sym->name = name;
+            block += sizeof(symbol_table_t) + ((ent->len + 8) & ~(size_t)7);
+            link_hash(sym, hashes[fresh[n]]);
+            added[nadded++] = sym;
+        }
+        assign_handle(sym, ent->val);
+    }
+
+    if(nadded > 0) {
+        nsymbols += nadded;
+        bool sorted = true;
+        for(int i = 1; i < nadded && sorted; i++)
+            sorted = strcmp(added[i - 1]->name, added[i]->name) < 0;
+        if(!sorted)
+            sort_nodes(added, nadded);
+        merge_nodes(added, nadded);
+    }
+
+    FREE(added);
+    FREE(fresh);
+    FREE(hashes);
+    return errors;
+}
+
+/**
+ * Assign a value to the symbol. If it is not found then return !0. Else
+ * return 0. The symbol takes the caller's reference to an array and drops
+ * the one to the array it held before.
+ */
+symbols_error_t assign_symbol(const char* name, value_t val) {
+
+    symbol_table_t* sym = find_node(name);
+    if(sym != NULL)
+        return assign_handle(sym, val);
+
     return SYM_NOT_FOUND;
 }
 
+/**
+ * Assign a value through a handle from find_handle().
+ */
+symbols_error_t assign_handle(symbol_table_t* sym, value_t val) {
+
+    if(sym->is_read_only)
+        return SYM_READ_ONLY;
+    if(sym->value.type == ARRAY_VAL)
+        use_arrays(-1);
+    if(val.type == ARRAY_VAL)
+        use_arrays(1);
+    release_value(sym->value);
+    sym->value = val;
+    sym->is_assigned = true;
+    sym->version++;
+    return SYM_NO_ERROR;
+}
+
+/**
+ * Return a handle for the symbol, or NULL if it does not exist. Symbols are
+ * never removed, so a handle stays good for as long as the calculator runs
+ * and can be kept in the AST to skip the search when the tree is evaluated.
+ */
+symbol_table_t* find_handle(const char* name) {
+
+    return find_node(name);
+}
+
+/**
+ * Set a symbol that scripts can read but not assign, adding it if it does
+ * not exist yet.
+ */
+symbols_error_t set_read_only(const char* name, value_t val) {
+
+    symbol_table_t* sym = find_node(name);
+    if(sym == NULL) {
+        add_symbol(name);
+        sym = find_node(name);
+    }
+
+    if(sym->value.type == ARRAY_VAL)
+        use_arrays(-1);
+    if(val.type == ARRAY_VAL)
+        use_arrays(1);
+    release_value(sym->value);
+    sym->value = val;
+    sym->is_assigned = true;
+    sym->version++;
+    sym->is_read_only = true;
+    return SYM_NO_ERROR;
+}
+
 /**
  * Find a symbol in the tree. If it exists and has been assigned, then return
  * a pointer to the value associated with it. Otherwise, return NULL.
  */
-symbols_error_t find_symbol(const char* name, double* val) {
+symbols_error_t find_symbol(const char* name, value_t* val) {
 
-    symbol_table_t* sym = recursive_find(root, name);
+    symbol_table_t* sym = find_node(name);
     if(sym != NULL) {
         if(val != NULL)
             *val = sym->value;
@@ -160,7 +524,7 @@ symbols_error_t find_symbol(const char* name, double* val) {
 
 symbols_error_t symbol_is_assigned(const char* name) {
 
-    symbol_table_t* sym = recursive_find(root, name);
+    symbol_table_t* sym = find_node(name);
     if(sym != NULL) {
         if(sym->is_assigned)
             return SYM_NO_ERROR;
@@ -172,10 +536,55 @@ symbols_error_t symbol_is_assigned(const char* name) {
 }
 
 /**
- * Traverse the tree and print each symbol with it's current value.
+ * Print the symbols whose names match the glob pattern, in name order, up to
+ * limit of them. A NULL pattern matches every name and a limit of 0 shows
+ * all of them. Only the names that start with the part of the pattern before
+ * the first wildcard are looked at.
  */
-void dump_symbols() {
+void dump_symbols(const char* pattern, int limit) {
+
+    static output_t out;
+    symbol_table_t* stack[MAX_HEIGHT];
+    int sp = 0;
+
+    if(pattern == NULL)
+        pattern = "*";
+    size_t plen = strcspn(pattern, "*?[\\");
+
+    // go down to the first name that is not less than the prefix
+    for(symbol_table_t* node = root; node != NULL; ) {
+        if(strncmp(node->name, pattern, plen) >= 0) {
+            stack[sp++] = node;
+            node = node->left;
+        }
+        else
+            node = node->right;
+    }
+
+    int shown = 0;
+    bool more = false;
+    out.len = 0;
+    out_printf(&out, "Dump symbol table\n");
+    while(sp > 0 && !atomic_load(&job_cancel)) {
+        symbol_table_t* node = stack[--sp];
+        if(strncmp(node->name, pattern, plen) != 0)
+            break;
+
+        if((pattern[plen] == '\0')? node->name[plen] == '\0' :
+                                    fnmatch(pattern, node->name, 0) == 0) {
+            if(limit > 0 && shown == limit) {
+                more = true;
+                break;
+            }
+            out_symbol(&out, node);
+            shown++;
+        }
+
+        for(node = node->right; node != NULL; node = node->left)
+            stack[sp++] = node;
+    }
 
-    printf("Dump symbol table\n");
-    recursive_dump(root);
+    if(more)
+        out_printf(&out, "Showing the first %d, use a larger limit or 0 to see more\n", limit);
+    out_flush(&out);
 }
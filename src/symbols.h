@@ -3,19 +3,48 @@
 #ifndef __SYMBOLS_H__
 #define __SYMBOLS_H__
 
+#include <stdint.h>
 #include <stdbool.h>
 
+#include "value.h"
+
+// symt shows at most this many symbols unless it is given a limit
+#define SYMT_LIMIT  1000
+
 typedef enum {
     SYM_NO_ERROR,
     SYM_NOT_FOUND,
     SYM_NOT_ASSIGNED,
     SYM_EXISTS,
+    SYM_READ_ONLY,
 } symbols_error_t;
 
+typedef struct _ste_t_ {
+    const char* name;
+    value_t value;
+    bool is_assigned;
+    bool is_read_only;
+    uint64_t version;   // counts the assignments, see memo.c
+    struct _ste_t_* left;
+    struct _ste_t_* right;
+    struct _ste_t_* next;   // in the hash bucket
+} symbol_table_t;
+
+// a name and value for add_symbols(), the name does not have to end in a zero
+typedef struct {
+    const char* name;
+    int len;
+    value_t val;
+} sym_entry_t;
+
 symbols_error_t add_symbol(const char* name); //, double val, bool flag);
-symbols_error_t assign_symbol(const char* name, double val);
-symbols_error_t find_symbol(const char* name, double* val);
+int add_symbols(sym_entry_t* list, int count);
+symbols_error_t assign_symbol(const char* name, value_t val);
+symbols_error_t assign_handle(symbol_table_t* sym, value_t val);
+symbol_table_t* find_handle(const char* name);
+symbols_error_t set_read_only(const char* name, value_t val);
+symbols_error_t find_symbol(const char* name, value_t* val);
 symbols_error_t symbol_is_assigned(const char* name);
-void dump_symbols();
+void dump_symbols(const char* pattern, int limit);
 
 #endif
@@ -0,0 +1,396 @@
+/*
+ * Arithmetic on tagged values. When both operands are integers the operation
+ * is done in 64 bits and checked for overflow. If it overflows, or if either
+ * operand is a double, then the operation is done in double.
+ *
+ * A decimal that meets an integer or another decimal stays a decimal. Both
+ * sides are brought to the larger scale and the operation is done in 128
+ * bits, so it cannot overflow on the way. A product or a quotient gets the
+ * larger scale, or the scale of decimal mode if that is more, and is rounded
+ * half away from zero to it. If the result does not fit in 64 bits it falls
+ * back to double, the same as an integer, and a message says that it is no
+ * longer exact.
+ */
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "value.h"
+#include "array.h"
+#include "error.h"
+
+int decimal_scale = 0;
+
+// powers of ten up to MAX_SCALE
+static const int64_t powers[MAX_SCALE + 1] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL,
+    1000000000000LL, 10000000000000LL, 100000000000000LL,
+    1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+    1000000000000000000LL,
+};
+
+static inline int scale_of(value_t val) {
+
+    return (val.type == DEC_VAL)? val.scale : 0;
+}
+
+/*
+ * Return true if the operation is done in decimal, which is when one side is
+ * a decimal and the other is a decimal or an integer.
+ */
+static inline bool is_decimal(value_t left, value_t right) {
+
+    return (left.type == DEC_VAL && (right.type == DEC_VAL || right.type == INT_VAL)) ||
+            (right.type == DEC_VAL && left.type == INT_VAL);
+}
+
+/*
+ * Multiply n by 10 to the power of exp, which can be up to twice MAX_SCALE.
+ * Return false if it overflows.
+ */
+static bool scale_up(__int128* n, int exp) {
+
+    while(exp > 0) {
+        int e = (exp > MAX_SCALE)? MAX_SCALE : exp;
+        if(__builtin_mul_overflow(*n, (__int128)powers[e], n))
+            return false;
+        exp -= e;
+    }
+
+    return true;
+}
+
+/*
+ * Divide and round half away from zero. A 128 bit division is much slower
+ * than a 64 bit one, so it is only done when it has to be.
+ */
+static __int128 div_round(__int128 n, __int128 d) {
+
+    if(n > INT64_MIN && n <= INT64_MAX && d > INT64_MIN && d <= INT64_MAX) {
+        int64_t q = (int64_t)n / (int64_t)d;
+        int64_t r = (int64_t)n % (int64_t)d;
+        if(r < 0)
+            r = -r;
+        if(r != 0 && r >= ((d < 0)? -(int64_t)d : (int64_t)d) - r)
+            q += ((n < 0) != (d < 0))? -1 : 1;
+        return q;
+    }
+
+    __int128 q = n / d;
+    __int128 r = n % d;
+    if(r < 0)
+        r = -r;
+    if(r != 0 && r >= ((d < 0)? -d : d) - r)
+        q += ((n < 0) != (d < 0))? -1 : 1;
+
+    return q;
+}
+
+/*
+ * Change n from one scale to another, rounding if there are fewer digits.
+ * Return false if it overflows.
+ */
+static bool rescale(__int128* n, int from, int to) {
+
+    if(to >= from)
+        return scale_up(n, to - from);
+
+    __int128 d = 1;
+    scale_up(&d, from - to);
+    *n = div_round(*n, d);
+    return true;
+}
+
+static void not_exact(int scale) {
+
+    msg(0, "decimal result does not fit in 64 bits with %d places, it is not exact", scale);
+}
+
+static value_t make_decimal(__int128 n, int scale) {
+
+    if(n < INT64_MIN || n > INT64_MAX) {
+        not_exact(scale);
+        return FLOAT_VALUE((double)n / powers[scale]);
+    }
+
+    return DEC_VALUE((int64_t)n, scale);
+}
+
+static value_t dec_add(value_t left, value_t right, bool sub) {
+
+    int scale = (scale_of(left) > scale_of(right))? scale_of(left) : scale_of(right);
+    __int128 a = (__int128)left.ival * powers[scale - scale_of(left)];
+    __int128 b = (__int128)right.ival * powers[scale - scale_of(right)];
+
+    return make_decimal(sub? a - b : a + b, scale);
+}
+
+static value_t dec_mul(value_t left, value_t right) {
+
+    int ls = scale_of(left);
+    int rs = scale_of(right);
+    int scale = (ls > rs)? ls : rs;
+    if(decimal_scale > scale)
+        scale = decimal_scale;
+
+    // the product has the digits of both sides
+    __int128 n = (__int128)left.ival * right.ival;
+    if(!rescale(&n, ls + rs, scale)) {
+        not_exact(scale);
+        return FLOAT_VALUE(value_to_double(left) * value_to_double(right));
+    }
+
+    return make_decimal(n, scale);
+}
+
+static value_t dec_div(value_t left, value_t right) {
+
+    int ls = scale_of(left);
+    int rs = scale_of(right);
+    int scale = (ls > rs)? ls : rs;
+    if(decimal_scale > scale)
+        scale = decimal_scale;
+
+    __int128 n = left.ival;
+    if(!rescale(&n, ls, scale + rs)) {
+        not_exact(scale);
+        return FLOAT_VALUE(value_to_double(left) / value_to_double(right));
+    }
+
+    return make_decimal(div_round(n, right.ival), scale);
+}
+
+static value_t dec_mod(value_t left, value_t right) {
+
+    int scale = (scale_of(left) > scale_of(right))? scale_of(left) : scale_of(right);
+    __int128 a = (__int128)left.ival * powers[scale - scale_of(left)];
+    __int128 b = (__int128)right.ival * powers[scale - scale_of(right)];
+
+    return make_decimal(a % b, scale);
+}
+
+double value_to_double(value_t val) {
+
+    if(val.type == INT_VAL)
+        return (double)val.ival;
+    if(val.type == DEC_VAL)
+        return (double)val.ival / powers[val.scale];
+    return (val.type == FLOAT_VAL)? val.fval : NAN;
+}
+
+bool value_is_zero(value_t val) {
+
+    if(val.type == INT_VAL || val.type == DEC_VAL)
+        return val.ival == 0;
+    return (val.type == FLOAT_VAL)? val.fval == 0.0 : false;
+}
+
+value_t value_add(value_t left, value_t right) {
+
+    int64_t res;
+    if(left.type == INT_VAL && right.type == INT_VAL)
+        if(!__builtin_add_overflow(left.ival, right.ival, &res))
+            return INT_VALUE(res);
+    if(is_decimal(left, right))
+        return dec_add(left, right, false);
+
+    return FLOAT_VALUE(value_to_double(left) + value_to_double(right));
+}
+
+value_t value_sub(value_t left, value_t right) {
+
+    int64_t res;
+    if(left.type == INT_VAL && right.type == INT_VAL)
+        if(!__builtin_sub_overflow(left.ival, right.ival, &res))
+            return INT_VALUE(res);
+    if(is_decimal(left, right))
+        return dec_add(left, right, true);
+
+    return FLOAT_VALUE(value_to_double(left) - value_to_double(right));
+}
+
+value_t value_mul(value_t left, value_t right) {
+
+    int64_t res;
+    if(left.type == INT_VAL && right.type == INT_VAL)
+        if(!__builtin_mul_overflow(left.ival, right.ival, &res))
+            return INT_VALUE(res);
+    if(is_decimal(left, right))
+        return dec_mul(left, right);
+
+    return FLOAT_VALUE(value_to_double(left) * value_to_double(right));
+}
+
+/*
+ * Integer division only stays an integer when it is exact. Otherwise it is a
+ * decimal in decimal mode and a double if not. The caller has already checked
+ * for a zero divisor.
+ */
+value_t value_div(value_t left, value_t right) {
+
+    if(left.type == INT_VAL && right.type == INT_VAL) {
+        if(!(left.ival == INT64_MIN && right.ival == -1) &&
+                left.ival % right.ival == 0)
+            return INT_VALUE(left.ival / right.ival);
+        if(decimal_scale > 0)
+            return dec_div(left, right);
+    }
+    else if(is_decimal(left, right))
+        return dec_div(left, right);
+
+    return FLOAT_VALUE(value_to_double(left) / value_to_double(right));
+}
+
+/*
+ * The C remainder has the sign of the dividend, the same as fmod(). The caller
+ * has already checked for a zero divisor.
+ */
+value_t value_mod(value_t left, value_t right) {
+
+    if(left.type == INT_VAL && right.type == INT_VAL) {
+        if(right.ival == -1)
+            return INT_VALUE(0); // INT64_MIN % -1 traps
+        return INT_VALUE(left.ival % right.ival);
+    }
+    if(is_decimal(left, right))
+        return dec_mod(left, right);
+
+    return FLOAT_VALUE(fmod(value_to_double(left), value_to_double(right)));
+}
+
+value_t value_neg(value_t val) {
+
+    if(val.type == INT_VAL && val.ival != INT64_MIN)
+        return INT_VALUE(-val.ival);
+    if(val.type == DEC_VAL && val.ival != INT64_MIN)
+        return DEC_VALUE(-val.ival, val.scale);
+
+    return FLOAT_VALUE(-value_to_double(val));
+}
+
+value_t value_abs(value_t val) {
+
+    if(val.type == INT_VAL && val.ival != INT64_MIN)
+        return INT_VALUE((val.ival < 0)? -val.ival : val.ival);
+    if(val.type == DEC_VAL && val.ival != INT64_MIN)
+        return DEC_VALUE((val.ival < 0)? -val.ival : val.ival, val.scale);
+
+    return FLOAT_VALUE(fabs(value_to_double(val)));
+}
+
+/*
+ * Read a number such as 12, -0.5 or 1.25e3 straight into a decimal with the
+ * scale, without going through a double. Digits past the scale are rounded.
+ * Return false if it is not a number or if it does not fit.
+ */
+bool parse_decimal(const char* str, int len, int scale, value_t* val) {
+
+    const char* p = str;
+    const char* end = str + len;
+    bool neg = false;
+    if(p < end && (*p == '-' || *p == '+'))
+        neg = (*p++ == '-');
+
+    // the digits are kept in n, and exp is the power of ten that goes with
+    // them to make the scaled value
+    __int128 n = 0;
+    int exp = scale;
+    int digits = 0;
+    bool point = false;
+    bool any = false;
+    for(; p < end; p++) {
+        if(*p == '.' && !point)
+            point = true;
+        else if(*p >= '0' && *p <= '9') {
+            any = true;
+            n = n * 10 + (*p - '0');
+            if(n != 0 && ++digits > 2 * MAX_SCALE)
+                return false;
+            if(point)
+                exp--;
+        }
+        else
+            break;
+    }
+
+    if(!any)
+        return false;
+
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool eneg = false;
+        if(p < end && (*p == '-' || *p == '+'))
+            eneg = (*p++ == '-');
+        int e = 0;
+        const char* first = p;
+        while(p < end && *p >= '0' && *p <= '9' && e < 1000)
+            e = e * 10 + (*p++ - '0');
+        if(p == first)
+            return false;
+        exp += eneg? -e : e;
+    }
+
+    if(p != end)
+        return false;
+
+    if(exp < -2 * MAX_SCALE)
+        n = 0;  // less than half of the last digit
+    else if(n != 0 && !rescale(&n, (exp < 0)? -exp : 0, (exp > 0)? exp : 0))
+        return false;
+
+    if(n > INT64_MAX)
+        return false;
+
+    *val = DEC_VALUE(neg? -(int64_t)n : (int64_t)n, scale);
+    return true;
+}
+
+/*
+ * Write a decimal with all of the digits of its scale, such as 1.50 for a
+ * scale of 2. The buffer has to hold DECIMAL_SIZE bytes.
+ */
+const char* format_decimal(char* buf, value_t val) {
+
+    uint64_t n = (val.ival < 0)? -(uint64_t)val.ival : (uint64_t)val.ival;
+    uint64_t frac = n % powers[val.scale];
+
+    char* p = buf + sprintf(buf, "%s%" PRIu64, (val.ival < 0)? "-" : "", n / powers[val.scale]);
+    if(val.scale > 0) {
+        *p++ = '.';
+        for(int i = val.scale - 1; i >= 0; i--) {
+            p[i] = '0' + frac % 10;
+            frac /= 10;
+        }
+        p += val.scale;
+    }
+    *p = '\0';
+
+    return buf;
+}
+
+/*
+ * Print the value on a line by itself, with the prefix in front of it.
+ */
+void print_value(const char* prefix, value_t val) {
+
+    char buf[DECIMAL_SIZE];
+
+    if(val.type == INT_VAL)
+        printf("%s%" PRId64 "\n", prefix, val.ival);
+    else if(val.type == DEC_VAL)
+        printf("%s%s\n", prefix, format_decimal(buf, val));
+    else if(val.type == ARRAY_VAL)
+        print_array(prefix, val.aval);
+    else
+        printf("%s%0.*f\n", prefix, FLOAT_DIGITS, val.fval);
+}
+
+/*
+ * Drop a reference to a value that the caller owns. This only does something
+ * for arrays.
+ */
+void release_value(value_t val) {
+
+    if(val.type == ARRAY_VAL)
+        unref_array(val.aval);
+}
@@ -0,0 +1,70 @@
+/*
+ * Numbers are carried through the evaluator as a tagged value. Integers are
+ * kept exact in 64 bits for as long as the arithmetic allows it and fall back
+ * to double when an operation overflows or produces a fraction. A value can
+ * also be an array, which only the array evaluator works on.
+ *
+ * In decimal mode a number with a point is a decimal, which is an integer
+ * scaled by a power of ten. See value.c for how decimals combine.
+ */
+#ifndef __VALUE_H__
+#define __VALUE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+typedef enum {
+    INT_VAL,
+    FLOAT_VAL,
+    ARRAY_VAL,
+    DEC_VAL,
+} value_type_t;
+
+// the most digits a decimal can have after the point
+#define MAX_SCALE   18
+
+// room for the longest decimal that format_decimal() writes
+#define DECIMAL_SIZE    32
+
+struct _array_t_;
+
+typedef struct {
+    value_type_t type;
+    int scale;                  // digits after the point of a decimal
+    union {
+        int64_t ival;
+        double fval;
+        struct _array_t_* aval; // reference counted, see array.h
+    };
+} value_t;
+
+#define INT_VALUE(v)    ((value_t){.type = INT_VAL, .ival = (v)})
+#define FLOAT_VALUE(v)  ((value_t){.type = FLOAT_VAL, .fval = (v)})
+#define NAN_VALUE       FLOAT_VALUE(NAN)
+#define ARRAY_VALUE(v)  ((value_t){.type = ARRAY_VAL, .aval = (v)})
+#define DEC_VALUE(v, s) ((value_t){.type = DEC_VAL, .scale = (s), .ival = (v)})
+
+// digits after the point in decimal mode, 0 when it is off
+extern int decimal_scale;
+
+// digits shown after the point of a double
+#define FLOAT_DIGITS    ((decimal_scale > 0)? decimal_scale : 3)
+
+double value_to_double(value_t val);
+bool value_is_zero(value_t val);
+
+value_t value_add(value_t left, value_t right);
+value_t value_sub(value_t left, value_t right);
+value_t value_mul(value_t left, value_t right);
+value_t value_div(value_t left, value_t right);
+value_t value_mod(value_t left, value_t right);
+value_t value_neg(value_t val);
+value_t value_abs(value_t val);
+
+bool parse_decimal(const char* str, int len, int scale, value_t* val);
+const char* format_decimal(char* buf, value_t val);
+void print_value(const char* prefix, value_t val);
+void release_value(value_t val);
+
+#endif
@@ -4,137 +4,261 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "ast.h"
+#include "visit.h"
 #include "error.h"
 #include "symbols.h"
+#include "pool.h"
+#include "builtin.h"
+#include "array.h"
+#include "job.h"
+#include "memory.h"
+
+// both sides of a binary node have to be at least this big to be worth
+// evaluating on separate threads
+#define PARALLEL_SIZE   0x4000
+
+// the left side of a chain this long is kept on the stack by visit_binary()
+#define SPINE_SIZE      8
+
+/*
+ * Evaluate the expression of an assignment or a print. An expression that
+ * makes an array is handed to the array evaluator as a whole.
+ */
+static value_t visit_expr(ast_t* expr) {
+
+    if(arrays_in_use() && is_array_expr(expr))
+        return eval_array(expr);
+
+    return expr->visit(expr);
+}
+
+/*
+ * Apply a binary operator to the values.
+ */
+static inline value_t apply_binary(op_type_t op, value_t left, value_t right) {
+
+    switch(op) {
+        case PLUS_OP:  return value_add(left, right);
+        case MINUS_OP: return value_sub(left, right);
+        case STAR_OP:  return value_mul(left, right);
+        case SLASH_OP:
+            if(value_is_zero(right)) {
+                error("divide by zero");
+                return NAN_VALUE;
+            }
+            return value_div(left, right);
+        case PERCENT_OP:
+            if(value_is_zero(right)) {
+                error("divide by zero");
+                return NAN_VALUE;
+            }
+            return value_mod(left, right);
+        default:
+            error("invalid binary node type: %s", OP_TOSTR(op));
+            return NAN_VALUE;
+    }
+}
+
+/*
+ * Read the number in a variable node through the symbol handle that was
+ * found when the node was made. Return false if there is no handle or if
+ * the symbol holds an array, so the caller can fall back to the general
+ * visitor, which reports the problem.
+ */
+static inline bool read_var(ast_t* node, value_t* val) {
+
+    symbol_table_t* sym = node->value.var->sym;
+    if(sym == NULL || sym->value.type == ARRAY_VAL)
+        return false;
+
+    *val = sym->value;
+    return true;
+}
+
+static void visit_task(task_t* task) {
+
+    ast_t* node = task->data;
+    task->result = node->visit(node);
+}
+
+static inline bool is_forked(ast_t* node) {
+
+    return node->left->size >= PARALLEL_SIZE &&
+            node->right->size >= PARALLEL_SIZE && pool_is_running();
+}
+
+/*
+ * The left side is handed to the pool and the right side is done here. The
+ * operation itself is the same either way, so the result does not depend on
+ * which thread did what. The task is kept out of visit_binary(), so that it
+ * does not make every frame of a deep tree bigger.
+ */
+static __attribute__((noinline)) value_t fork_binary(ast_t* node) {
+
+    task_t task = { .func = visit_task, .data = node->left };
+    fork_task(&task);
+    value_t right = node->right->visit(node->right);
+    join_task(&task);
+
+    return apply_binary(node->value.op->op, task.result, right);
+}
+
+/*
+ * The number of nodes that a binary node counts for the progress of the job,
+ * which is itself and the children that are not counted by visit_binary().
+ */
+static inline int node_work(ast_t* node) {
+
+    return 1 + ((node->left->visit != visit_binary)? node->left->size : 0) +
+            ((node->right->visit != visit_binary)? node->right->size : 0);
+}
 
 /*
  * Visit node with literal number.
  */
-double visit_literal(ast_t* node) {
+value_t visit_literal(ast_t* node) {
 
     msg(2, "Visit %s AST node", NT_TOSTR(node->type));
     if(node != NULL)
         return node->value.val->val;
     else {
         error("invalid literal node");
-        return NAN; // Not A Number
+        return NAN_VALUE; // Not A Number
     }
 
-    return NAN; // unreachable
+    return NAN_VALUE; // unreachable
 }
 
 /*
  * Visit node with a variable from the symbol table.
  */
-double visit_variable(ast_t* node) {
+value_t visit_variable(ast_t* node) {
 
     msg(2, "Visit %s AST node", NT_TOSTR(node->type));
     if(node != NULL) {
-        double val;
+        value_t val;
         const char* name = node->value.var->name;
-        if(SYM_NO_ERROR == find_symbol(name, &val))
+        if(read_var(node, &val))
+            return val;
+        if(SYM_NO_ERROR == find_symbol(name, &val)) {
+            if(val.type == ARRAY_VAL) {
+                error("array \"%s\" used where a number is expected", name);
+                return NAN_VALUE;
+            }
             return val;
+        }
         else {
             error("symbol \"%s\" is not defined", name);
-            return NAN; // not a number
+            return NAN_VALUE; // not a number
         }
     }
     else {
         error("invalid symbol node");
-        return NAN; // not a number
+        return NAN_VALUE; // not a number
     }
 
-    return NAN; // unreachable
+    return NAN_VALUE; // unreachable
 }
 
 /*
  * Perform a unary operation.
  */
-double visit_unary(ast_t* node) {
+value_t visit_unary(ast_t* node) {
 
     msg(2, "Visit %s AST node", NT_TOSTR(node->type));
     if(node != NULL) {
         //node_type_t type = node->type;
-        double val;
+        value_t val;
         if(node->left != NULL)
             val = node->left->visit(node->left);
         else {
             error("invalid unary child node");
-            return NAN;
+            return NAN_VALUE;
         }
         switch(node->value.op->op) {
             case PLUS_OP:
-                return fabs(val);
+                return value_abs(val);
             case MINUS_OP:
-                return - val;
+                return value_neg(val);
             default:
                 error("invalid unary node type: %s", OP_TOSTR(node->value.op->op));
-                return NAN;
+                return NAN_VALUE;
         }
     }
     else {
         error("invalid unary node");
-        return NAN; // not a number
+        return NAN_VALUE; // not a number
     }
 
-    return NAN; // unreachable
+    return NAN_VALUE; // unreachable
 }
 
 /*
- * Perform a binary operation.
+ * Perform a binary operation. A long expression such as a+b+c+... is a chain
+ * of binary nodes down the left side, so the chain is followed in a loop
+ * instead of by recursion, and its length is not limited by the stack. The
+ * operations are done in the same order either way.
  */
-double visit_binary(ast_t* node) {
+value_t visit_binary(ast_t* node) {
 
     msg(2, "Visit %s AST node", NT_TOSTR(node->type));
-    if(node != NULL) {
-        //node_type_t type = node->type;
-        double left;
-        double right;
+    if(node == NULL) {
+        error("invalid binary node");
+        return NAN_VALUE; // not a number
+    }
 
-        if(node->left != NULL)
-            left = node->left->visit(node->left);
-        else {
-            error("invalid left binary child node");
-            return NAN;
-        }
+    if(node->left == NULL) {
+        error("invalid left binary child node");
+        return NAN_VALUE;
+    }
 
-        if(node->right != NULL)
-            right = node->right->visit(node->right);
-        else {
-            error("invalid right binary child node");
-            return NAN;
-        }
+    if(node->right == NULL) {
+        error("invalid right binary child node");
+        return NAN_VALUE;
+    }
 
-        switch(node->value.op->op) {
-            case PLUS_OP:  return  left + right;
-            case MINUS_OP: return  left - right;
-            case STAR_OP:  return  left * right;
-            case SLASH_OP:
-                if(right == 0.0) {
-                    error("divide by zero");
-                    return NAN;
-                }
-                return left / right;
-            case PERCENT_OP:
-                if(right == 0.0) {
-                    error("divide by zero");
-                    return NAN;
-                }
-                return fmod(left, right);
-            default:
-                error("invalid binary node type: %s", OP_TOSTR(node->value.op->op));
-                return NAN;
+    if(is_forked(node))
+        return fork_binary(node);
+
+    ast_t* stack[SPINE_SIZE];
+    ast_t** spine = stack;
+    int cap = SPINE_SIZE;
+    int len = 0;
+
+    spine[len++] = node;
+    for(node = node->left; node->visit == visit_binary && node->left != NULL &&
+                node->right != NULL && !is_forked(node); node = node->left) {
+        if(len + 1 > cap) {
+            cap <<= 1;
+            if(spine == stack) {
+                spine = ALLOC_LST(cap, ast_t*);
+                memcpy(spine, stack, sizeof(stack));
+            }
+            else
+                spine = REALLOC_LST(spine, cap, ast_t*);
         }
+        msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+        spine[len++] = node;
     }
-    else {
-        error("invalid binary node");
-        return NAN; // not a number
+
+    value_t left = node->visit(node);
+    while(len > 0) {
+        node = spine[--len];
+        if(job_progress(node_work(node))) {
+            left = NAN_VALUE;
+            break;
+        }
+        value_t right = node->right->visit(node->right);
+        left = apply_binary(node->value.op->op, left, right);
     }
 
-    return NAN; // unreachable
+    if(spine != stack)
+        FREE(spine);
+    return left;
 }
 
 /*
@@ -142,70 +266,86 @@ double visit_binary(ast_t* node) {
  * right item is the value to assign. This function causes the AST to be
  * traversed so that the assignment can be made.
  */
-double visit_assign(ast_t* node) {
+value_t visit_assign(ast_t* node) {
 
     msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+    if(job_cancelled())
+        return NAN_VALUE;
     if(node != NULL) {
         //node_type_t type = node->type;
-        double left;    // identifier node
-        double right;   // expression node
+        value_t left;   // identifier node
+        value_t right;  // expression node
         const char* name;
 
         if(node->left != NULL) {
             name = node->left->value.var->name;
             if(SYM_NO_ERROR != find_symbol(name, &left)) {
                 error("symbol \"%s\" is not defined", name);
-                return NAN;
+                return NAN_VALUE;
             }
         }
         else {
             error("invalid left assign child node");
-            return NAN;
+            return NAN_VALUE;
         }
 
         if(node->right != NULL)
-            right = node->right->visit(node->right);
+            right = visit_expr(node->right);
         else {
             error("invalid right assign child node");
-            return NAN;
+            return NAN_VALUE;
+        }
+
+        // a cancelled value is not assigned, so the symbol keeps its old one
+        if(job_cancelled()) {
+            release_value(right);
+            return NAN_VALUE;
         }
 
         switch(node->value.op->op) {
             case ASSIGN_OP:
-                if(SYM_NO_ERROR != assign_symbol(name, right)) {
-                    error("symbol \"%s\" is not found", name);
-                    return NAN;
+                switch(assign_symbol(name, right)) {
+                    case SYM_NO_ERROR:
+                        return right;
+                    case SYM_READ_ONLY:
+                        error("symbol \"%s\" is read only", name);
+                        break;
+                    default:
+                        error("symbol \"%s\" is not found", name);
+                        break;
                 }
-                else
-                    return right;
+                release_value(right);
+                return NAN_VALUE;
             default:
                 error("invalid assign node type: %s", OP_TOSTR(node->value.op->op));
-                return NAN;
+                return NAN_VALUE;
         }
     }
     else {
         error("invalid assign node");
-        return NAN; // not a number
+        return NAN_VALUE; // not a number
     }
 
-    return NAN; // unreachable
+    return NAN_VALUE; // unreachable
 }
 
 /*
  * Perform a unary operation where the operation is "print". This traverses the
  * tree to obtain the value to print out.
  */
-double visit_print(ast_t* node) {
+value_t visit_print(ast_t* node) {
 
     msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+    if(job_cancelled())
+        return NAN_VALUE;
     if(node != NULL) {
         //node_type_t type = node->type;
-        double val;
+        value_t val;
         if(node->left != NULL)
-            val = node->left->visit(node->left);
+            val = visit_expr(node->left);
         else {
             error("invalid print child node");
-            return NAN;
+            return NAN_VALUE;
         }
         switch(node->value.op->op) {
             case PRINT_OP:
@@ -213,14 +353,131 @@ double visit_print(ast_t* node) {
                 return val;
             default:
                 error("invalid print node type: %s", OP_TOSTR(node->value.op->op));
-                return NAN;
+                return NAN_VALUE;
         }
     }
     else {
         error("invalid print node");
-        return NAN; // not a number
+        return NAN_VALUE; // not a number
+    }
+
+    return NAN_VALUE; // unreachable
+}
+
+/*
+ * Call a built-in function. The function was found when the call was parsed,
+ * so this is a call through the table by index. The array reductions give a
+ * number, but range() and load() can only be used where an array can.
+ */
+value_t visit_call(ast_t* node) {
+
+    msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+    if(node != NULL && builtins[node->value.call->func].kind != MATH_FUNC) {
+        const builtin_t* func = &builtins[node->value.call->func];
+        if(func->kind == RANGE_FUNC || func->kind == LOAD_FUNC) {
+            error("%s() used where a number is expected", func->name);
+            return NAN_VALUE;
+        }
+        return reduce_array(node);
+    }
+    else if(node != NULL && node->left != NULL) {
+        const builtin_t* func = &builtins[node->value.call->func];
+        double a = value_to_double(node->left->visit(node->left));
+        double b = 0.0;
+        if(node->right != NULL)
+            b = value_to_double(node->right->visit(node->right));
+
+        return FLOAT_VALUE(func->func(a, b));
+    }
+    else {
+        error("invalid call node");
+        return NAN_VALUE; // not a number
     }
 
-    return NAN; // unreachable
+    return NAN_VALUE; // unreachable
+}
+
+/*
+ * The visitors below are for the node shapes picked out by the AST builder.
+ * They read their operands straight out of the child nodes. Anything out of
+ * the ordinary goes to the general visitor.
+ */
+
+/*
+ * Variable operator literal.
+ */
+value_t visit_var_lit(ast_t* node) {
+
+    msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+
+    value_t left;
+    if(!read_var(node->left, &left))
+        return visit_binary(node);
+
+    return apply_binary(node->value.op->op, left, node->right->value.val->val);
 }
 
+/*
+ * Literal operator variable.
+ */
+value_t visit_lit_var(ast_t* node) {
+
+    msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+
+    value_t right;
+    if(!read_var(node->right, &right))
+        return visit_binary(node);
+
+    return apply_binary(node->value.op->op, node->left->value.val->val, right);
+}
+
+/*
+ * Variable operator variable.
+ */
+value_t visit_var_var(ast_t* node) {
+
+    msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+
+    value_t left;
+    value_t right;
+    if(!read_var(node->left, &left) || !read_var(node->right, &right))
+        return visit_binary(node);
+
+    return apply_binary(node->value.op->op, left, right);
+}
+
+/*
+ * Negated variable.
+ */
+value_t visit_neg_var(ast_t* node) {
+
+    msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+
+    value_t val;
+    if(!read_var(node->left, &val))
+        return visit_unary(node);
+
+    return value_neg(val);
+}
+
+/*
+ * Assignment of variable operator literal, such as "x = x + 1".
+ */
+value_t visit_assign_var_lit(ast_t* node) {
+
+    msg(2, "Visit %s AST node", NT_TOSTR(node->type));
+
+    symbol_table_t* sym = node->left->value.var->sym;
+    ast_t* expr = node->right;
+    value_t val;
+    if(sym == NULL || !read_var(expr->left, &val))
+        return visit_assign(node);
+
+    val = apply_binary(expr->value.op->op, val, expr->right->value.val->val);
+    if(SYM_READ_ONLY == assign_handle(sym, val)) {
+        error("symbol \"%s\" is read only", sym->name);
+        return NAN_VALUE;
+    }
+
+    return val;
+}
@@ -6,11 +6,18 @@
 
 #include "ast.h"
 
-double visit_literal(ast_t* node);
-double visit_variable(ast_t* node);
-double visit_unary(ast_t* node);
-double visit_binary(ast_t* node);
-double visit_assign(ast_t* node);
-double visit_print(ast_t* node);
+value_t visit_literal(ast_t* node);
+value_t visit_variable(ast_t* node);
+value_t visit_unary(ast_t* node);
+value_t visit_binary(ast_t* node);
+value_t visit_assign(ast_t* node);
+value_t visit_print(ast_t* node);
+value_t visit_call(ast_t* node);
+
+value_t visit_var_lit(ast_t* node);
+value_t visit_lit_var(ast_t* node);
+value_t visit_var_var(ast_t* node);
+value_t visit_neg_var(ast_t* node);
+value_t visit_assign_var_lit(ast_t* node);
 
 #endif